@@ -3,15 +3,36 @@
 // COMP1521 20T3 Assignment 2
 // Written by Jeffery Pan (z5310210)
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
+#include <endian.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/openat2.h>)
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#define HAVE_OPENAT2
+#endif
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_SHA_NI
+#endif
+
 // the first byte of every blobette has this value
 #define BLOBETTE_MAGIC_NUMBER          0x42
 
@@ -26,11 +47,55 @@
 #define BLOBETTE_MAX_PATHNAME_LENGTH   65535
 #define BLOBETTE_MAX_CONTENT_LENGTH    281474976710655
 
+// optional extended header, present when this bit is set in the mode field
+// holds the preserved mtime as seconds then nanoseconds
+#define BLOBETTE_EXTENDED_HEADER_FLAG  0x800000
+#define BLOBETTE_MTIME_SEC_BYTES       8
+#define BLOBETTE_MTIME_NSEC_BYTES      4
+
+// v2 blobs start with a file header, followed by fixed-size little-endian
+// member headers aligned to 8 bytes. non-empty content starts on a
+// 4 KiB boundary so it can be read with direct I/O or mmap
+#define BLOB_V2_MAGIC                  "\x89" "BLOBV2\n"
+#define BLOB_V2_MAGIC_BYTES            8
+#define BLOB_V2_VERSION                2
+#define BLOB_V2_MEMBER_MAGIC           0x4D424C42 // "BLBM"
+#define BLOB_V2_HEADER_ALIGNMENT       8
+#define BLOB_V2_CONTENT_ALIGNMENT      4096
+
+// bits in the flags field of a v2 member header
+#define BLOB_V2_HAS_MTIME              0x1
+#define BLOB_V2_HAS_OWNER              0x2
+#define BLOB_V2_HAS_CHECKSUM           0x4
+#define BLOB_V2_COMPRESSED             0x8
+
+#define SHA256_DIGEST_BYTES            32
+#define SHA256_BLOCK_BYTES             64
+
 
 // misc
 #define BITS_IN_BYTE 8
 #define LAST_8_BITS 0xFF
 
+// number of parent directory fds kept open during extraction
+#define PARENT_FD_CACHE_SIZE 16
+
+// size of buffer used to copy content
+#define COPY_BUFFER_SIZE 65536
+
+// size of each of the two buffers blobs are created through
+// and the alignment O_DIRECT needs for buffers, offsets and lengths
+#define BLOB_WRITER_BUFFER_SIZE (4 * 1024 * 1024)
+#define DIRECT_IO_ALIGNMENT 4096
+
+// values returned by getopt_long for options with no short form
+#define OPT_DIRECT 256
+#define OPT_SKIP_IDENTICAL 257
+
+// sidecar file in the extraction root caching digests of extracted files
+#define DIGEST_CACHE_PATHNAME ".blobby-digests"
+#define DIGEST_CACHE_INITIAL_CAPACITY 1024
+
 
 
 typedef enum action {
@@ -40,14 +105,126 @@ typedef enum action {
     a_create
 } action_t;
 
+// a directory whose mode and mtime are applied after extraction
+typedef struct pending_dir {
+    char *pathname;
+    long mode;
+    int has_mtime;
+    struct timespec mtime;
+} pending_dir_t;
+
+// recently used parent directories of extracted members, opened
+// beneath the extraction root, so siblings skip the path walk
+typedef struct parent_fd_cache {
+    char *pathnames[PARENT_FD_CACHE_SIZE];
+    int fds[PARENT_FD_CACHE_SIZE];
+    int next;
+} parent_fd_cache_t;
+
+// content digest of a file, valid while its (dev, ino, mtime, size)
+// are unchanged. ctime is checked too, as mtime can be set back
+// entries not seen during an extraction are dropped when it is saved
+typedef struct digest_entry {
+    int used;
+    int seen;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime;
+    off_t size;
+    uint8_t digest[SHA256_DIGEST_BYTES];
+} digest_entry_t;
+
+// open-addressed hash table of digest entries keyed by (dev, ino)
+typedef struct digest_cache {
+    digest_entry_t *entries;
+    size_t capacity;
+    size_t n_entries;
+    int modified;
+} digest_cache_t;
+
+// everything extraction tracks across members
+typedef struct extract_state {
+    uint64_t blob_size;
+    int root_fd;
+    parent_fd_cache_t parent_cache;
+    pending_dir_t *dirs;
+    int n_dirs;
+    int skip_identical;
+    digest_cache_t digests;
+} extract_state_t;
+
+// v2 file header, stored little-endian
+typedef struct blob_v2_header {
+    uint8_t magic[BLOB_V2_MAGIC_BYTES];
+    uint32_t version;
+    uint32_t member_header_size;
+    uint32_t content_alignment;
+    uint32_t reserved;
+} blob_v2_header_t;
+
+// v2 member header, stored little-endian, followed by the pathname
+// every field is naturally aligned so the header is read in one go
+typedef struct blob_v2_member {
+    uint32_t magic;
+    uint32_t mode;
+    uint64_t content_length;
+    uint64_t content_offset;
+    uint64_t compressed_length;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t uid;
+    uint32_t gid;
+    uint16_t pathname_length;
+    uint16_t flags;
+    uint8_t checksum[SHA256_DIGEST_BYTES];
+    uint64_t reserved;
+} blob_v2_member_t;
+
+_Static_assert(sizeof(blob_v2_header_t) == 24, "v2 file header layout");
+_Static_assert(sizeof(blob_v2_member_t) == 96, "v2 member header layout");
+
+// double-buffered sequential writer used to create blobs
+// one buffer is filled while a thread writes out the other
+typedef struct blob_writer {
+    char *pathname;
+    int fd;
+    int direct_io;
+    uint8_t *buffers[2];
+    int current;
+    size_t fill;
+    uint64_t offset;
+
+    // shared with the writer thread, guarded by lock
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending;
+    int pending_buffer;
+    size_t pending_length;
+    int done;
+    int error;
+} blob_writer_t;
+
+typedef struct sha256 {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t block[SHA256_BLOCK_BYTES];
+    size_t block_length;
+} sha256_t;
+
 
 void usage(char *myname);
 action_t process_arguments(int argc, char *argv[], char **blob_pathname,
-                           char ***pathnames, int *compress_blob);
+                           char ***pathnames, int *compress_blob,
+                           int *preserve_mtime, char **extract_root,
+                           int *format_version, int *direct_io,
+                           int *skip_identical);
 
 void list_blob(char *blob_pathname);
-void extract_blob(char *blob_pathname);
-void create_blob(char *blob_pathname, char *pathnames[], int compress_blob);
+void extract_blob(char *blob_pathname, char *extract_root, int skip_identical);
+void create_blob(char *blob_pathname, char *pathnames[], int compress_blob,
+                 int preserve_mtime, int format_version, int direct_io);
 
 uint8_t blobby_hash(uint8_t hash, uint8_t byte);
 
@@ -55,9 +232,71 @@ uint8_t blobby_hash(uint8_t hash, uint8_t byte);
 // ADD YOUR FUNCTION PROTOTYPES HERE
 long blobbete_mode(FILE *fp, long curr_byte, uint8_t *hash_p);
 unsigned long blobbete_name_content_len(FILE *fp, long curr_byte,
-                                        char pathname[BLOBETTE_MAX_PATHNAME_LENGTH],
+                                        char pathname[BLOBETTE_MAX_PATHNAME_LENGTH + 1],
                                         uint8_t *hash_p);
 uint8_t fgetc_hash(FILE *fp, uint8_t *hash_p);
+void blobbete_mtime(FILE *fp, struct timespec *mtime, uint8_t *hash_p);
+void apply_file_metadata(FILE *extracted_file, char *pathname, long mode,
+                         int has_mtime, struct timespec *mtime);
+void apply_dir_metadata(int root_fd, pending_dir_t *dirs, int n_dirs);
+int pending_dir_deepest_first(const void *a, const void *b);
+int open_beneath(int root_fd, char *pathname, int flags, mode_t mode);
+void open_beneath_failed(char *pathname);
+int open_parent(int root_fd, parent_fd_cache_t *cache, char *pathname,
+                char **basename);
+int extract_open_parent(extract_state_t *state, char *pathname, char **basename);
+int blob_format_version(FILE *fp);
+void list_blob_v2(FILE *fp, uint64_t blob_size);
+void extract_blob_v1(FILE *fp, extract_state_t *state);
+void extract_blob_v2(FILE *fp, extract_state_t *state);
+void create_blob_v2(char *blob_pathname, char *pathnames[], int direct_io);
+int blob_v2_read_member(FILE *fp, uint64_t blob_size, blob_v2_member_t *member,
+                        char pathname[BLOBETTE_MAX_PATHNAME_LENGTH + 1]);
+void blob_v2_member_byteswap(blob_v2_member_t *member);
+uint64_t blob_v2_next_member(blob_v2_member_t *member);
+uint64_t blob_file_size(FILE *fp);
+void blob_check_range(uint64_t blob_size, uint64_t offset, uint64_t n_bytes);
+void extract_dir(extract_state_t *state, char *pathname, long mode,
+                 int has_mtime, struct timespec *mtime);
+FILE *create_extracted_file(extract_state_t *state, char *pathname);
+uint64_t align_up(uint64_t offset, uint64_t alignment);
+int member_is_identical(extract_state_t *state, char *pathname, long mode,
+                        uint64_t content_length, int has_mtime,
+                        struct timespec *mtime, uint8_t *checksum);
+int blobbete_is_identical(FILE *fp, uint8_t *hash_p, extract_state_t *state,
+                          char *pathname, long mode, unsigned long content_length,
+                          int has_mtime, struct timespec *mtime);
+void blobbete_read_content(FILE *fp, uint8_t *buffer, size_t n_bytes, uint8_t *hash_p);
+void digest_cache_load(digest_cache_t *cache, int root_fd);
+void digest_cache_save(digest_cache_t *cache, int root_fd);
+digest_entry_t *digest_cache_find(digest_cache_t *cache, struct stat *stats);
+void digest_cache_put(digest_cache_t *cache, struct stat *stats,
+                      uint8_t digest[SHA256_DIGEST_BYTES]);
+digest_entry_t *digest_cache_slot(digest_cache_t *cache, dev_t dev, ino_t ino);
+void blob_writer_open(blob_writer_t *writer, char *blob_pathname, int direct_io);
+void blob_writer_put(blob_writer_t *writer, const void *data, size_t n_bytes,
+                     uint8_t *hash_p);
+void blob_writer_put_be(blob_writer_t *writer, uint64_t value, int n_bytes,
+                        uint8_t *hash_p);
+void blob_writer_copy(blob_writer_t *writer, int in_fd, char *in_pathname,
+                      uint64_t content_length, uint8_t *hash_p, sha256_t *sha);
+void blob_writer_pad(blob_writer_t *writer, size_t n_bytes);
+size_t blob_writer_block_tail(blob_writer_t *writer, uint8_t *dest);
+void blob_writer_rewrite(blob_writer_t *writer, uint64_t offset,
+                         const uint8_t *data, size_t n_bytes);
+void blob_writer_close(blob_writer_t *writer);
+void blob_writer_drain(blob_writer_t *writer);
+void blob_writer_submit(blob_writer_t *writer);
+void *blob_writer_thread(void *arg);
+void sha256_init(sha256_t *sha);
+void sha256_update(sha256_t *sha, const uint8_t *data, size_t length);
+void sha256_final(sha256_t *sha, uint8_t digest[SHA256_DIGEST_BYTES]);
+void sha256_block(sha256_t *sha, const uint8_t block[SHA256_BLOCK_BYTES]);
+void sha256_block_generic(sha256_t *sha, const uint8_t block[SHA256_BLOCK_BYTES]);
+#ifdef HAVE_SHA_NI
+void sha256_detect_sha_ni(void);
+void sha256_block_sha_ni(sha256_t *sha, const uint8_t block[SHA256_BLOCK_BYTES]);
+#endif
 
 
 // YOU SHOULD NOT NEED TO CHANGE main, usage or process_arguments
@@ -66,8 +305,15 @@ int main(int argc, char *argv[]) {
     char *blob_pathname = NULL;
     char **pathnames = NULL;
     int compress_blob = 0;
+    int preserve_mtime = 0;
+    char *extract_root = ".";
+    int format_version = 1;
+    int direct_io = 0;
+    int skip_identical = 0;
     action_t action = process_arguments(argc, argv, &blob_pathname, &pathnames,
-                                        &compress_blob);
+                                        &compress_blob, &preserve_mtime,
+                                        &extract_root, &format_version,
+                                        &direct_io, &skip_identical);
 
     switch (action) {
     case a_list:
@@ -75,11 +321,12 @@ int main(int argc, char *argv[]) {
         break;
 
     case a_extract:
-        extract_blob(blob_pathname);
+        extract_blob(blob_pathname, extract_root, skip_identical);
         break;
 
     case a_create:
-        create_blob(blob_pathname, pathnames, compress_blob);
+        create_blob(blob_pathname, pathnames, compress_blob, preserve_mtime,
+                    format_version, direct_io);
         break;
 
     default:
@@ -94,8 +341,11 @@ int main(int argc, char *argv[]) {
 void usage(char *myname) {
     fprintf(stderr, "Usage:\n");
     fprintf(stderr, "\t%s -l <blob-file>\n", myname);
-    fprintf(stderr, "\t%s -x <blob-file>\n", myname);
-    fprintf(stderr, "\t%s [-z] -c <blob-file> pathnames [...]\n", myname);
+    fprintf(stderr, "\t%s [-C <dir>] [--skip-identical] -x <blob-file>\n", myname);
+    fprintf(stderr, "\t%s [-z] [-p] [--direct] -c <blob-file> pathnames [...]\n",
+            myname);
+    fprintf(stderr, "\t%s -2 [--direct] -c <blob-file> pathnames [...]\n", myname);
+    fprintf(stderr, "\t(v2 blobs always store mtimes and are never compressed)\n");
     exit(1);
 }
 
@@ -105,16 +355,29 @@ void usage(char *myname) {
 // **blob_pathname set to pathname for blobfile
 // ***pathname set to a list of pathnames for the create action
 // *compress_blob set to an integer for create action
+// *preserve_mtime set to an integer for create action
+// **extract_root set to directory to extract into for extract action
+// *format_version set to the blob format for create action
+// *direct_io set to an integer for create action
+// *skip_identical set to an integer for extract action
 
 action_t process_arguments(int argc, char *argv[], char **blob_pathname,
-                           char ***pathnames, int *compress_blob) {
+                           char ***pathnames, int *compress_blob,
+                           int *preserve_mtime, char **extract_root,
+                           int *format_version, int *direct_io,
+                           int *skip_identical) {
     extern char *optarg;
     extern int optind, optopt;
     int create_blob_flag = 0;
     int extract_blob_flag = 0;
     int list_blob_flag = 0;
+    static struct option long_options[] = {
+        { "direct", no_argument, NULL, OPT_DIRECT },
+        { "skip-identical", no_argument, NULL, OPT_SKIP_IDENTICAL },
+        { NULL, 0, NULL, 0 }
+    };
     int opt;
-    while ((opt = getopt(argc, argv, ":l:c:x:z")) != -1) {
+    while ((opt = getopt_long(argc, argv, ":l:c:x:zpC:2", long_options, NULL)) != -1) {
         switch (opt) {
         case 'c':
             create_blob_flag++;
@@ -135,6 +398,26 @@ action_t process_arguments(int argc, char *argv[], char **blob_pathname,
             (*compress_blob)++;
             break;
 
+        case 'p':
+            (*preserve_mtime)++;
+            break;
+
+        case 'C':
+            *extract_root = optarg;
+            break;
+
+        case '2':
+            *format_version = 2;
+            break;
+
+        case OPT_DIRECT:
+            (*direct_io)++;
+            break;
+
+        case OPT_SKIP_IDENTICAL:
+            (*skip_identical)++;
+            break;
+
         default:
             return a_invalid;
         }
@@ -144,6 +427,12 @@ action_t process_arguments(int argc, char *argv[], char **blob_pathname,
         return a_invalid;
     }
 
+    // v2 always stores mtimes and has no compression yet
+    if (*format_version == 2 && (*preserve_mtime || *compress_blob)) {
+        fprintf(stderr, "%s: -p and -z cannot be used with -2\n", argv[0]);
+        return a_invalid;
+    }
+
     if (list_blob_flag && argv[optind] == NULL) {
         return a_list;
     } else if (extract_blob_flag && argv[optind] == NULL) {
@@ -168,6 +457,13 @@ void list_blob(char *blob_pathname) {
         exit(1);
     }
 
+    uint64_t blob_size = blob_file_size(fp);
+    if (blob_format_version(fp) == 2) {
+        list_blob_v2(fp, blob_size);
+        fclose(fp);
+        return;
+    }
+
     // hashes are not checked in this function
     // but hash and hash pointer initialised to 
     // make sure sub-functions will run properly
@@ -188,10 +484,18 @@ void list_blob(char *blob_pathname) {
         long mode = blobbete_mode(fp, curr_byte, hash_p); 
 
         // find pathname and the length of contents
-        char pathname[BLOBETTE_MAX_PATHNAME_LENGTH];
+        char pathname[BLOBETTE_MAX_PATHNAME_LENGTH + 1];
         unsigned long content_length = blobbete_name_content_len(fp, curr_byte, pathname, hash_p);    
 
+        // skip over the extended header if present
+        if (mode & BLOBETTE_EXTENDED_HEADER_FLAG) {
+            struct timespec mtime;
+            blobbete_mtime(fp, &mtime, hash_p);
+            mode &= ~BLOBETTE_EXTENDED_HEADER_FLAG;
+        }
+
         // seek till end of the current blobette
+        blob_check_range(blob_size, ftell(fp), content_length + BLOBETTE_HASH_BYTES);
         fseek(fp, content_length + 1, SEEK_CUR); // + 1 for hash
 
         // print perms, size and name
@@ -206,9 +510,11 @@ void list_blob(char *blob_pathname) {
 }
 
 
-// extract the contents of blob_pathname
+// extract the contents of blob_pathname into extract_root
+// members are never created outside extract_root
+// files already matching their member are left alone if skip_identical non-zero
 
-void extract_blob(char *blob_pathname) {
+void extract_blob(char *blob_pathname, char *extract_root, int skip_identical) {
     FILE *fp = fopen(blob_pathname, "r"); 
 
     // exit with error if no such directory or file
@@ -217,11 +523,155 @@ void extract_blob(char *blob_pathname) {
         exit(1);
     }
 
+    extract_state_t state = {
+        .blob_size = blob_file_size(fp),
+        .parent_cache = { .next = 0 },
+        .dirs = NULL,
+        .n_dirs = 0,
+        .skip_identical = skip_identical,
+        .digests = { .entries = NULL, .capacity = 0 }
+    };
+    state.root_fd = open(extract_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (state.root_fd < 0) {
+        perror(extract_root);
+        exit(1);
+    }
+
+    if (skip_identical) {
+        digest_cache_load(&state.digests, state.root_fd);
+    }
+
+    if (blob_format_version(fp) == 2) {
+        extract_blob_v2(fp, &state);
+    } else {
+        extract_blob_v1(fp, &state);
+    }
+
+    // directories are created writable and their real mode and mtime
+    // applied once every member inside them has been extracted
+    apply_dir_metadata(state.root_fd, state.dirs, state.n_dirs);
+
+    if (skip_identical) {
+        digest_cache_save(&state.digests, state.root_fd);
+        free(state.digests.entries);
+    }
+    for (int i = 0; i < state.n_dirs; i++) {
+        free(state.dirs[i].pathname);
+    }
+    free(state.dirs);
+
+    for (int i = 0; i < PARENT_FD_CACHE_SIZE; i++) {
+        if (state.parent_cache.pathnames[i] != NULL) {
+            free(state.parent_cache.pathnames[i]);
+            close(state.parent_cache.fds[i]);
+        }
+    }
+    close(state.root_fd);
+
+    fclose(fp);
+    return;
+}
+
+// create blob_pathname from NULL-terminated array pathnames
+// compress with xz if compress_blob non-zero (subset 4)
+// store each file's mtime in an extended header if preserve_mtime non-zero
+// write the v2 format if format_version is 2
+// write with O_DIRECT and drop inputs from the page cache if direct_io non-zero
+
+void create_blob(char *blob_pathname, char *pathnames[], int compress_blob,
+                 int preserve_mtime, int format_version, int direct_io) {
+    if (format_version == 2) {
+        create_blob_v2(blob_pathname, pathnames, direct_io);
+        return;
+    }
+
+    // blobettes are written sequentially, hashing as they go
+    blob_writer_t writer;
+    blob_writer_open(&writer, blob_pathname, direct_io);
+
+    // loop through files and insert them into the blob
+    for (int i = 0; pathnames[i] != NULL; i++) {
+        int curr_fd = open(pathnames[i], O_RDONLY | O_CLOEXEC);
+
+        // exit with error if no such directory or file
+        if (curr_fd < 0) {
+            perror(pathnames[i]);
+            exit(1);
+        }
+
+        // print current process to terminal
+        printf("Adding: %s\n", pathnames[i]);
+
+        // obtain metadata of file
+        struct stat curr_stats;
+        if (fstat(curr_fd, &curr_stats) != 0) {
+            perror(pathnames[i]);
+            exit(1);
+        } 
+
+        if (direct_io) {
+            posix_fadvise(curr_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+
+        uint8_t hash = 0;
+
+        // insert magic number 
+        blob_writer_put_be(&writer, BLOBETTE_MAGIC_NUMBER, BLOBETTE_MAGIC_NUMBER_BYTES, &hash);
+
+        // mode, flagging the extended header if there is one
+        long mode = curr_stats.st_mode;
+        if (preserve_mtime) {
+            mode |= BLOBETTE_EXTENDED_HEADER_FLAG;
+        }
+        blob_writer_put_be(&writer, mode, BLOBETTE_MODE_LENGTH_BYTES, &hash);
+
+        // lengths of pathname and contents
+        unsigned int pathname_length = strlen(pathnames[i]);
+        if (pathname_length > BLOBETTE_MAX_PATHNAME_LENGTH) {
+            fprintf(stderr, "ERROR: %s: pathname too long\n", pathnames[i]);
+            exit(1);
+        }
+        blob_writer_put_be(&writer, pathname_length, BLOBETTE_PATHNAME_LENGTH_BYTES, &hash);
+
+        // only regular files have content; directories are recorded with
+        // length 0 as in the reference blobs, not their st_size
+        unsigned long content_length = S_ISREG(curr_stats.st_mode) ? curr_stats.st_size : 0;
+        blob_writer_put_be(&writer, content_length, BLOBETTE_CONTENT_LENGTH_BYTES, &hash);
+
+        // insert pathname in
+        blob_writer_put(&writer, pathnames[i], pathname_length, &hash);
+
+        // insert extended header
+        if (preserve_mtime) {
+            blob_writer_put_be(&writer, curr_stats.st_mtim.tv_sec, BLOBETTE_MTIME_SEC_BYTES, &hash);
+            blob_writer_put_be(&writer, curr_stats.st_mtim.tv_nsec, BLOBETTE_MTIME_NSEC_BYTES, &hash);
+        }
+
+        // insert contents
+        blob_writer_copy(&writer, curr_fd, pathnames[i], content_length, &hash, NULL);
+
+        if (direct_io) {
+            posix_fadvise(curr_fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        close(curr_fd);
+
+        // insert hash
+        blob_writer_put(&writer, &hash, BLOBETTE_HASH_BYTES, NULL);
+    }
+
+    blob_writer_close(&writer);
+}
+
+
+// ADD YOUR FUNCTIONS HERE
+
+// extract each blobette of a v1 blob
+
+void extract_blob_v1(FILE *fp, extract_state_t *state) {
     //
     uint8_t hash = 0;
     uint8_t *hash_p = &hash;
 
-
     // loop to extract each blobbete    
     for (long curr_byte = fgetc(fp); curr_byte != EOF; curr_byte = fgetc(fp)) {
         // update the hash
@@ -237,26 +687,73 @@ void extract_blob(char *blob_pathname) {
         long mode = blobbete_mode(fp, curr_byte, hash_p);
 
         // find pathname and the length of contents
-        char pathname[BLOBETTE_MAX_PATHNAME_LENGTH];
+        char pathname[BLOBETTE_MAX_PATHNAME_LENGTH + 1];
         unsigned long content_length = blobbete_name_content_len(fp, curr_byte, pathname, hash_p);
-        
-        // print process to terminal
-        printf("Extracting: %s\n", pathname);
 
-        // create new file with current blobbete's pathname
-        FILE *extracted_file = fopen(pathname, "w");        
-        for (unsigned long i = 0; i < content_length; i++) {
-            fputc(fgetc_hash(fp, hash_p), extracted_file);
+        // read preserved mtime from the extended header if present
+        int has_mtime = (mode & BLOBETTE_EXTENDED_HEADER_FLAG) != 0;
+        struct timespec mtime = { 0, 0 };
+        if (has_mtime) {
+            blobbete_mtime(fp, &mtime, hash_p);
+            mode &= ~BLOBETTE_EXTENDED_HEADER_FLAG;
         }
 
-        // set perms according to mode and
-        // print error if failed
-        if (chmod(pathname, mode) != 0) {
-            perror(pathname);  
-            exit(1);
-        }        
-
-        fclose(extracted_file);
+        // don't create anything for content the blob doesn't hold
+        blob_check_range(state->blob_size, ftell(fp), content_length + BLOBETTE_HASH_BYTES);
+
+        if (S_ISDIR(mode)) {
+            extract_dir(state, pathname, mode, has_mtime, &mtime);
+
+            // older blobs record a directory's st_size as its content
+            // length, so that content is read to check the hash
+            for (unsigned long i = 0; i < content_length; i++) {
+                fgetc_hash(fp, hash_p);
+            }
+        } else if (state->skip_identical
+                   && blobbete_is_identical(fp, hash_p, state, pathname, mode,
+                                            content_length, has_mtime, &mtime)) {
+            // the content has been read, updating the hash
+            printf("Unchanged: %s\n", pathname);
+        } else {
+            // create new file with current blobbete's pathname
+            FILE *extracted_file = create_extracted_file(state, pathname);
+
+            // copy content in blocks, hashing as we go; the digest is
+            // only needed to remember the file for --skip-identical
+            sha256_t sha;
+            sha256_init(&sha);
+            uint8_t buffer[COPY_BUFFER_SIZE];
+            unsigned long remaining = content_length;
+            while (remaining > 0) {
+                size_t n_bytes = remaining < sizeof buffer ? remaining : sizeof buffer;
+                blobbete_read_content(fp, buffer, n_bytes, hash_p);
+                if (state->skip_identical) {
+                    sha256_update(&sha, buffer, n_bytes);
+                }
+                if (fwrite(buffer, 1, n_bytes, extracted_file) != n_bytes) {
+                    perror(pathname);
+                    exit(1);
+                }
+                remaining -= n_bytes;
+            }
+
+            // set perms and mtime through the open file
+            apply_file_metadata(extracted_file, pathname, mode, has_mtime, &mtime);
+
+            struct stat written_stats;
+            if (fstat(fileno(extracted_file), &written_stats) != 0
+                || fclose(extracted_file) != 0) {
+                perror(pathname);
+                exit(1);
+            }
+
+            // remember the digest so the next extraction need not hash it
+            if (state->skip_identical) {
+                uint8_t digest[SHA256_DIGEST_BYTES];
+                sha256_final(&sha, digest);
+                digest_cache_put(&state->digests, &written_stats, digest);
+            }
+        }
 
         // checking the hash byte
         curr_byte = fgetc(fp);
@@ -266,109 +763,982 @@ void extract_blob(char *blob_pathname) {
             exit(1);            
         }        
     }
+}
 
-    fclose(fp);
-    return;
+// detect the format of the blob open on fp from its first bytes
+// leaves fp at the first blobette of a v1 blob
+// or at the first member header of a v2 blob
+
+int blob_format_version(FILE *fp) {
+    int first_byte = fgetc(fp);
+    if (first_byte == EOF) {
+        return 1;
+    }
+    ungetc(first_byte, fp);
+    if (first_byte == BLOBETTE_MAGIC_NUMBER) {
+        return 1;
+    }
+
+    blob_v2_header_t header;
+    if (fread(&header, sizeof header, 1, fp) != 1
+        || memcmp(header.magic, BLOB_V2_MAGIC, BLOB_V2_MAGIC_BYTES) != 0) {
+        fprintf(stderr, "ERROR: Magic byte of blobette incorrect\n");
+        exit(1);
+    }
+
+    if (le32toh(header.version) != BLOB_V2_VERSION
+        || le32toh(header.member_header_size) != sizeof(blob_v2_member_t)) {
+        fprintf(stderr, "ERROR: unsupported blob version\n");
+        exit(1);
+    }
+
+    return 2;
 }
 
-// create blob_pathname from NULL-terminated array pathnames
-// compress with xz if compress_blob non-zero (subset 4)
+// list the contents of a v2 blob of blob_size bytes
 
-void create_blob(char *blob_pathname, char *pathnames[], int compress_blob) {
-    int i = 0;
+void list_blob_v2(FILE *fp, uint64_t blob_size) {
+    blob_v2_member_t member;
+    char pathname[BLOBETTE_MAX_PATHNAME_LENGTH + 1];
 
-    // open new blob for reading and writing
-    FILE *new_blob = fopen(blob_pathname, "w+");
+    while (blob_v2_read_member(fp, blob_size, &member, pathname)) {
+        printf("%06lo %5lu %s\n", (long)member.mode,
+               (unsigned long)member.content_length, pathname);
 
-    // open a file to insert as a blobbete
-    FILE *curr_file = fopen(pathnames[i], "r");
+        fseek(fp, blob_v2_next_member(&member), SEEK_SET);
+    }
+}
 
-    // loop through files and insert them into the blob
-    while (pathnames[i] != NULL) {
-        curr_file = fopen(pathnames[i], "r");              
+// extract each member of a v2 blob, checking content checksums
 
-        // exit with error if no such directory or file
-        if (curr_file == NULL) {
-            perror(pathnames[i]);
+void extract_blob_v2(FILE *fp, extract_state_t *state) {
+    blob_v2_member_t member;
+    char pathname[BLOBETTE_MAX_PATHNAME_LENGTH + 1];
+    uint8_t buffer[COPY_BUFFER_SIZE];
+
+    while (blob_v2_read_member(fp, state->blob_size, &member, pathname)) {
+        if (member.flags & BLOB_V2_COMPRESSED) {
+            fprintf(stderr, "ERROR: %s: compressed members are not supported\n",
+                    pathname);
             exit(1);
         }
 
-        // print current process to terminal
-        printf("Adding: %s\n", pathnames[i]);
+        long mode = member.mode;
+        int has_mtime = (member.flags & BLOB_V2_HAS_MTIME) != 0;
+        struct timespec mtime = { member.mtime_sec, member.mtime_nsec };
+
+        uint8_t *checksum = (member.flags & BLOB_V2_HAS_CHECKSUM) ? member.checksum : NULL;
+
+        if (S_ISDIR(mode)) {
+            extract_dir(state, pathname, mode, has_mtime, &mtime);
+        } else if (state->skip_identical
+                   && member_is_identical(state, pathname, mode, member.content_length,
+                                          has_mtime, &mtime, checksum)) {
+            printf("Unchanged: %s\n", pathname);
+        } else {
+            FILE *extracted_file = create_extracted_file(state, pathname);
+
+            // copy content in blocks, hashing as we go
+            sha256_t sha;
+            sha256_init(&sha);
+            fseek(fp, member.content_offset, SEEK_SET);
+            uint64_t remaining = member.content_length;
+            while (remaining > 0) {
+                size_t n_bytes = remaining < sizeof buffer ? remaining : sizeof buffer;
+                if (fread(buffer, 1, n_bytes, fp) != n_bytes) {
+                    fprintf(stderr, "ERROR: blob truncated\n");
+                    exit(1);
+                }
+                sha256_update(&sha, buffer, n_bytes);
+                if (fwrite(buffer, 1, n_bytes, extracted_file) != n_bytes) {
+                    perror(pathname);
+                    exit(1);
+                }
+                remaining -= n_bytes;
+            }
+
+            // set perms and mtime through the open file
+            apply_file_metadata(extracted_file, pathname, mode, has_mtime, &mtime);
+
+            struct stat written_stats;
+            if (fstat(fileno(extracted_file), &written_stats) != 0
+                || fclose(extracted_file) != 0) {
+                perror(pathname);
+                exit(1);
+            }
+
+            uint8_t digest[SHA256_DIGEST_BYTES];
+            sha256_final(&sha, digest);
+            if (checksum != NULL && memcmp(digest, checksum, SHA256_DIGEST_BYTES) != 0) {
+                fprintf(stderr, "ERROR: blob hash incorrect\n");
+                exit(1);
+            }
+
+            // remember the digest so the next extraction need not hash it
+            if (state->skip_identical) {
+                digest_cache_put(&state->digests, &written_stats, digest);
+            }
+        }
 
-        // obtain metadata of file
+        fseek(fp, blob_v2_next_member(&member), SEEK_SET);
+    }
+}
+
+// create a v2 blob_pathname from NULL-terminated array pathnames
+// each member records mtime, owner and a SHA-256 of its content
+
+void create_blob_v2(char *blob_pathname, char *pathnames[], int direct_io) {
+    // members are written sequentially; each header is put as a
+    // placeholder and rewritten once its content's checksum is known
+    blob_writer_t writer;
+    blob_writer_open(&writer, blob_pathname, direct_io);
+
+    blob_v2_header_t header = {
+        .version = htole32(BLOB_V2_VERSION),
+        .member_header_size = htole32(sizeof(blob_v2_member_t)),
+        .content_alignment = htole32(BLOB_V2_CONTENT_ALIGNMENT)
+    };
+    memcpy(header.magic, BLOB_V2_MAGIC, BLOB_V2_MAGIC_BYTES);
+    blob_writer_put(&writer, &header, sizeof header, NULL);
+
+    for (int i = 0; pathnames[i] != NULL; i++) {
+        // metadata comes from the same open file the content is read from
+        int curr_fd = open(pathnames[i], O_RDONLY | O_CLOEXEC);
         struct stat curr_stats;
-        if (stat(pathnames[i], &curr_stats) != 0) {
+        if (curr_fd < 0 || fstat(curr_fd, &curr_stats) != 0) {
             perror(pathnames[i]);
             exit(1);
-        } 
+        }
 
-        // insert magic number 
-        fputc(BLOBETTE_MAGIC_NUMBER, new_blob);
+        printf("Adding: %s\n", pathnames[i]);
 
-        // deconstruct mode and place bytes
-        long mode = curr_stats.st_mode;
-        int shift = (BLOBETTE_MODE_LENGTH_BYTES - 1) * BITS_IN_BYTE;        
-        while (shift >= 0) {
-            fputc((mode >> shift) & LAST_8_BITS, new_blob);
-            shift -= BITS_IN_BYTE;            
+        size_t pathname_length = strlen(pathnames[i]);
+        if (pathname_length > BLOBETTE_MAX_PATHNAME_LENGTH) {
+            fprintf(stderr, "ERROR: %s: pathname too long\n", pathnames[i]);
+            exit(1);
         }
 
-        // deconstruct length of pathname and place bytes
-        unsigned int pathname_length = strlen(pathnames[i]);
-        shift = BITS_IN_BYTE;        
-        while (shift >= 0) {
-            fputc((pathname_length >> shift) & LAST_8_BITS, new_blob);
-            shift -= BITS_IN_BYTE;            
+        if (direct_io) {
+            posix_fadvise(curr_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
         }
 
-        // deconstruct content length and place bytes
-        unsigned long content_length = curr_stats.st_size;
-        shift = (BLOBETTE_CONTENT_LENGTH_BYTES - 1) * BITS_IN_BYTE;        
-        while (shift >= 0) {
-            fputc((content_length >> shift) & LAST_8_BITS, new_blob);
-            shift -= BITS_IN_BYTE;            
+        blob_v2_member_t member = {
+            .magic = BLOB_V2_MEMBER_MAGIC,
+            .mode = curr_stats.st_mode,
+            .content_length = S_ISREG(curr_stats.st_mode) ? curr_stats.st_size : 0,
+            .mtime_sec = curr_stats.st_mtim.tv_sec,
+            .mtime_nsec = curr_stats.st_mtim.tv_nsec,
+            .uid = curr_stats.st_uid,
+            .gid = curr_stats.st_gid,
+            .pathname_length = pathname_length,
+            .flags = BLOB_V2_HAS_MTIME | BLOB_V2_HAS_OWNER | BLOB_V2_HAS_CHECKSUM
+        };
+
+        // content goes on the next 4 KiB boundary after the pathname
+        uint64_t header_offset = writer.offset;
+        uint64_t pathname_end = header_offset + sizeof member + pathname_length;
+        member.content_offset = member.content_length > 0
+                                ? align_up(pathname_end, BLOB_V2_CONTENT_ALIGNMENT)
+                                : pathname_end;
+        uint64_t next_member = blob_v2_next_member(&member);
+
+        sha256_t sha;
+        sha256_init(&sha);
+        blob_v2_member_t le_member;
+
+        if (member.content_length == 0) {
+            sha256_final(&sha, member.checksum);
+            le_member = member;
+            blob_v2_member_byteswap(&le_member);
+            blob_writer_put(&writer, &le_member, sizeof le_member, NULL);
+            blob_writer_put(&writer, pathnames[i], pathname_length, NULL);
+        } else {
+            // stage every block from the one holding the header up to the
+            // content, so the header can be rewritten with whole aligned
+            // blocks as O_DIRECT needs. the content starts on a block
+            // boundary so the staged blocks never include any of it
+            uint64_t block_start = header_offset - header_offset % DIRECT_IO_ALIGNMENT;
+            size_t staged_length = member.content_offset - block_start;
+            uint8_t *staged;
+            if (posix_memalign((void **)&staged, DIRECT_IO_ALIGNMENT, staged_length) != 0) {
+                fprintf(stderr, "ERROR: out of memory\n");
+                exit(1);
+            }
+            memset(staged, 0, staged_length);
+            size_t header_start = blob_writer_block_tail(&writer, staged);
+
+            le_member = member;
+            blob_v2_member_byteswap(&le_member);
+            memcpy(staged + header_start, &le_member, sizeof le_member);
+            memcpy(staged + header_start + sizeof le_member, pathnames[i], pathname_length);
+            blob_writer_put(&writer, staged + header_start, staged_length - header_start, NULL);
+
+            blob_writer_copy(&writer, curr_fd, pathnames[i], member.content_length,
+                             NULL, &sha);
+
+            // now fill in the checksum
+            sha256_final(&sha, member.checksum);
+            memcpy(le_member.checksum, member.checksum, SHA256_DIGEST_BYTES);
+            memcpy(staged + header_start, &le_member, sizeof le_member);
+            blob_writer_rewrite(&writer, block_start, staged, staged_length);
+            free(staged);
         }
 
-        // insert pathname in
-        for (unsigned int ch = 0; ch < pathname_length; ch++) {        
-            fputc(pathnames[i][ch], new_blob);
+        if (direct_io) {
+            posix_fadvise(curr_fd, 0, 0, POSIX_FADV_DONTNEED);
         }
+        close(curr_fd);
 
-        // insert contents
-        for (unsigned long j = 0; j < content_length; j++) {
-            fputc(fgetc(curr_file), new_blob);
+        // pad to the next member header
+        blob_writer_pad(&writer, next_member - writer.offset);
+    }
+
+    blob_writer_close(&writer);
+}
+
+// read the next v2 member header and its pathname, converting the
+// header to host byte order. returns 0 at the end of the blob
+// blob_size bounds the content the header may claim
+
+int blob_v2_read_member(FILE *fp, uint64_t blob_size, blob_v2_member_t *member,
+                        char pathname[BLOBETTE_MAX_PATHNAME_LENGTH + 1]) {
+    size_t n_bytes = fread(member, 1, sizeof *member, fp);
+    if (n_bytes == 0 && feof(fp)) {
+        return 0;
+    }
+    if (n_bytes != sizeof *member) {
+        fprintf(stderr, "ERROR: blob truncated\n");
+        exit(1);
+    }
+    blob_v2_member_byteswap(member);
+
+    if (member->magic != BLOB_V2_MEMBER_MAGIC) {
+        fprintf(stderr, "ERROR: Magic byte of blobette incorrect\n");
+        exit(1);
+    }
+
+    if (fread(pathname, 1, member->pathname_length, fp) != member->pathname_length) {
+        fprintf(stderr, "ERROR: blob truncated\n");
+        exit(1);
+    }
+    pathname[member->pathname_length] = '\0';
+
+    // content must follow the pathname, so every member moves the
+    // reader forward, and must lie within the blob
+    uint64_t stored_length = (member->flags & BLOB_V2_COMPRESSED)
+                             ? member->compressed_length
+                             : member->content_length;
+    if (member->content_offset < (uint64_t)ftell(fp)) {
+        fprintf(stderr, "ERROR: %s: content offset invalid\n", pathname);
+        exit(1);
+    }
+    blob_check_range(blob_size, member->content_offset, stored_length);
+
+    return 1;
+}
+
+// convert a v2 member header between little-endian and host order
+// (the conversion is its own inverse)
+
+void blob_v2_member_byteswap(blob_v2_member_t *member) {
+    member->magic = le32toh(member->magic);
+    member->mode = le32toh(member->mode);
+    member->content_length = le64toh(member->content_length);
+    member->content_offset = le64toh(member->content_offset);
+    member->compressed_length = le64toh(member->compressed_length);
+    member->mtime_sec = le64toh(member->mtime_sec);
+    member->mtime_nsec = le32toh(member->mtime_nsec);
+    member->uid = le32toh(member->uid);
+    member->gid = le32toh(member->gid);
+    member->pathname_length = le16toh(member->pathname_length);
+    member->flags = le16toh(member->flags);
+}
+
+// offset of the member header following member (in host order)
+
+uint64_t blob_v2_next_member(blob_v2_member_t *member) {
+    uint64_t stored_length = (member->flags & BLOB_V2_COMPRESSED)
+                             ? member->compressed_length
+                             : member->content_length;
+    return align_up(member->content_offset + stored_length, BLOB_V2_HEADER_ALIGNMENT);
+}
+
+// open blob_pathname for writing through writer
+// with direct_io non-zero the blob bypasses the page cache via O_DIRECT
+
+void blob_writer_open(blob_writer_t *writer, char *blob_pathname, int direct_io) {
+    writer->pathname = blob_pathname;
+    writer->direct_io = direct_io;
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    writer->fd = open(blob_pathname, flags | (direct_io ? O_DIRECT : 0), 0666);
+    if (writer->fd < 0 && direct_io && errno == EINVAL) {
+        // file system does not support O_DIRECT
+        fprintf(stderr, "%s: O_DIRECT not supported, writing through the page cache\n",
+                blob_pathname);
+        writer->direct_io = 0;
+        writer->fd = open(blob_pathname, flags, 0666);
+    }
+    if (writer->fd < 0) {
+        perror(blob_pathname);
+        exit(1);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (posix_memalign((void **)&writer->buffers[i], DIRECT_IO_ALIGNMENT,
+                           BLOB_WRITER_BUFFER_SIZE) != 0) {
+            fprintf(stderr, "ERROR: out of memory\n");
+            exit(1);
         }
+    }
+    writer->current = 0;
+    writer->fill = 0;
+    writer->offset = 0;
+
+    writer->pending = 0;
+    writer->done = 0;
+    writer->error = 0;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+    if (pthread_create(&writer->thread, NULL, blob_writer_thread, writer) != 0) {
+        fprintf(stderr, "ERROR: could not start writer thread\n");
+        exit(1);
+    }
+}
 
-        // finding the hash        
-        uint8_t hash = 0;
-        
-        // size of blobette (minus the hash byte)
-        long blobbete_n_bytes_without_hash = BLOBETTE_MAGIC_NUMBER_BYTES + BLOBETTE_MODE_LENGTH_BYTES
-                                        + BLOBETTE_PATHNAME_LENGTH_BYTES + BLOBETTE_CONTENT_LENGTH_BYTES
-                                        + pathname_length + content_length;
+// append n_bytes of data to the blob, updating *hash_p if not NULL
+
+void blob_writer_put(blob_writer_t *writer, const void *data, size_t n_bytes,
+                     uint8_t *hash_p) {
+    const uint8_t *bytes = data;
+    while (n_bytes > 0) {
+        size_t space = BLOB_WRITER_BUFFER_SIZE - writer->fill;
+        size_t chunk = n_bytes < space ? n_bytes : space;
+        uint8_t *dest = writer->buffers[writer->current] + writer->fill;
+
+        memcpy(dest, bytes, chunk);
+        if (hash_p != NULL) {
+            for (size_t i = 0; i < chunk; i++) {
+                *hash_p = blobby_hash(*hash_p, dest[i]);
+            }
+        }
 
-        // seek back to start of current file
-        fseek(new_blob, -blobbete_n_bytes_without_hash, SEEK_CUR);
+        writer->fill += chunk;
+        writer->offset += chunk;
+        bytes += chunk;
+        n_bytes -= chunk;
 
-        // loop thru file and update hash for each byte 
-        for (unsigned long j = 0; j < blobbete_n_bytes_without_hash; j++) {
-            hash = blobby_hash(hash, fgetc(new_blob));
-        } 
+        if (writer->fill == BLOB_WRITER_BUFFER_SIZE) {
+            blob_writer_submit(writer);
+        }
+    }
+}
 
-        // insert hash
-        fputc(hash, new_blob);                
+// append the lowest n_bytes of value, most significant byte first
 
-        i++;
+void blob_writer_put_be(blob_writer_t *writer, uint64_t value, int n_bytes,
+                        uint8_t *hash_p) {
+    uint8_t bytes[sizeof value];
+    for (int i = 0; i < n_bytes; i++) {
+        bytes[i] = (value >> ((n_bytes - 1 - i) * BITS_IN_BYTE)) & LAST_8_BITS;
     }
+    blob_writer_put(writer, bytes, n_bytes, hash_p);
+}
 
-    fclose(new_blob);
-    fclose(curr_file);
+// append content_length bytes read from in_fd, updating *hash_p
+// and sha if they are not NULL. input is read straight into the writer's buffers, so reading
+// overlaps with the writer thread flushing the other buffer
+
+void blob_writer_copy(blob_writer_t *writer, int in_fd, char *in_pathname,
+                      uint64_t content_length, uint8_t *hash_p, sha256_t *sha) {
+    uint64_t remaining = content_length;
+    while (remaining > 0) {
+        size_t space = BLOB_WRITER_BUFFER_SIZE - writer->fill;
+        size_t chunk = remaining < space ? remaining : space;
+        uint8_t *dest = writer->buffers[writer->current] + writer->fill;
+
+        ssize_t n_read = read(in_fd, dest, chunk);
+        if (n_read < 0) {
+            perror(in_pathname);
+            exit(1);
+        } else if (n_read == 0) {
+            fprintf(stderr, "ERROR: %s: file changed while reading\n", in_pathname);
+            exit(1);
+        }
+
+        if (hash_p != NULL) {
+            for (ssize_t i = 0; i < n_read; i++) {
+                *hash_p = blobby_hash(*hash_p, dest[i]);
+            }
+        }
+        if (sha != NULL) {
+            sha256_update(sha, dest, n_read);
+        }
+
+        writer->fill += n_read;
+        writer->offset += n_read;
+        remaining -= n_read;
+
+        if (writer->fill == BLOB_WRITER_BUFFER_SIZE) {
+            blob_writer_submit(writer);
+        }
+    }
+}
 
+// append n_bytes of zeros to the blob
+
+void blob_writer_pad(blob_writer_t *writer, size_t n_bytes) {
+    static const uint8_t zeros[BLOB_V2_HEADER_ALIGNMENT];
+    while (n_bytes > 0) {
+        size_t chunk = n_bytes < sizeof zeros ? n_bytes : sizeof zeros;
+        blob_writer_put(writer, zeros, chunk, NULL);
+        n_bytes -= chunk;
+    }
 }
 
+// copy the bytes put since the last DIRECT_IO_ALIGNMENT boundary to dest
+// and return how many there were. buffers are submitted only when full,
+// so these are always still in the current buffer
+
+size_t blob_writer_block_tail(blob_writer_t *writer, uint8_t *dest) {
+    size_t n_bytes = writer->offset % DIRECT_IO_ALIGNMENT;
+    memcpy(dest, writer->buffers[writer->current] + writer->fill - n_bytes, n_bytes);
+    return n_bytes;
+}
+
+// overwrite n_bytes of the blob at offset, which must already have been put,
+// with data. offset and n_bytes must be multiples of DIRECT_IO_ALIGNMENT
+// and data aligned to it, as the part already handed to the writer thread
+// is rewritten in place with pwrite
+
+void blob_writer_rewrite(blob_writer_t *writer, uint64_t offset,
+                         const uint8_t *data, size_t n_bytes) {
+    uint64_t buffer_start = writer->offset - writer->fill;
+
+    if (offset < buffer_start) {
+        blob_writer_drain(writer);
+
+        size_t n_flushed = buffer_start - offset < n_bytes ? buffer_start - offset : n_bytes;
+        size_t written = 0;
+        while (written < n_flushed) {
+            ssize_t n_written = pwrite(writer->fd, data + written, n_flushed - written,
+                                       offset + written);
+            if (n_written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror(writer->pathname);
+                exit(1);
+            }
+            written += n_written;
+        }
+
+        offset += n_flushed;
+        data += n_flushed;
+        n_bytes -= n_flushed;
+    }
+
+    memcpy(writer->buffers[writer->current] + (offset - buffer_start), data, n_bytes);
+}
+
+// wait until the writer thread has written everything submitted to it
+
+void blob_writer_drain(blob_writer_t *writer) {
+    pthread_mutex_lock(&writer->lock);
+    while (writer->pending) {
+        pthread_cond_wait(&writer->cond, &writer->lock);
+    }
+    if (writer->error != 0) {
+        errno = writer->error;
+        perror(writer->pathname);
+        exit(1);
+    }
+    pthread_mutex_unlock(&writer->lock);
+}
+
+// flush what is buffered, wait for the writer thread and close the blob
+// with O_DIRECT the last block is padded to alignment then truncated off
+
+void blob_writer_close(blob_writer_t *writer) {
+    if (writer->fill > 0) {
+        if (writer->direct_io) {
+            size_t padded = align_up(writer->fill, DIRECT_IO_ALIGNMENT);
+            memset(writer->buffers[writer->current] + writer->fill, 0,
+                   padded - writer->fill);
+            writer->fill = padded;
+        }
+        blob_writer_submit(writer);
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    writer->done = 1;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    if (writer->error != 0 || ftruncate(writer->fd, writer->offset) != 0
+        || close(writer->fd) != 0) {
+        errno = writer->error != 0 ? writer->error : errno;
+        perror(writer->pathname);
+        exit(1);
+    }
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->cond);
+    free(writer->buffers[0]);
+    free(writer->buffers[1]);
+}
+
+// hand the current buffer to the writer thread and switch to the other
+// waits first for the writer thread to finish with the other buffer
+
+void blob_writer_submit(blob_writer_t *writer) {
+    blob_writer_drain(writer);
+
+    pthread_mutex_lock(&writer->lock);
+    writer->pending = 1;
+    writer->pending_buffer = writer->current;
+    writer->pending_length = writer->fill;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+
+    writer->current = !writer->current;
+    writer->fill = 0;
+}
+
+// writer thread: write each submitted buffer to the blob in full
+
+void *blob_writer_thread(void *arg) {
+    blob_writer_t *writer = arg;
+
+    pthread_mutex_lock(&writer->lock);
+    while (1) {
+        while (!writer->pending && !writer->done) {
+            pthread_cond_wait(&writer->cond, &writer->lock);
+        }
+        if (!writer->pending) {
+            break;
+        }
+
+        uint8_t *buffer = writer->buffers[writer->pending_buffer];
+        size_t length = writer->pending_length;
+        pthread_mutex_unlock(&writer->lock);
+
+        int error = 0;
+        size_t written = 0;
+        while (written < length) {
+            ssize_t n_bytes = write(writer->fd, buffer + written, length - written);
+            if (n_bytes < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                error = errno;
+                break;
+            }
+            written += n_bytes;
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        if (error != 0) {
+            writer->error = error;
+        }
+        writer->pending = 0;
+        pthread_cond_broadcast(&writer->cond);
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    return NULL;
+}
+
+// check whether the file at pathname already matches a regular file
+// member, so writing it can be skipped. size and permissions must
+// match, and mtime if the blob preserved one. if the blob stores a
+// checksum, the existing file's digest must match it too; digests are
+// looked up in the digest cache before hashing the file. with no
+// checksum only metadata is compared, so callers without a preserved
+// mtime must compare content themselves
+
+int member_is_identical(extract_state_t *state, char *pathname, long mode,
+                        uint64_t content_length, int has_mtime,
+                        struct timespec *mtime, uint8_t *checksum) {
+    char *basename;
+    int parent_fd = extract_open_parent(state, pathname, &basename);
+
+    struct stat existing;
+    if (fstatat(parent_fd, basename, &existing, AT_SYMLINK_NOFOLLOW) != 0
+        || !S_ISREG(existing.st_mode)
+        || (uint64_t)existing.st_size != content_length
+        || (existing.st_mode & ~S_IFMT) != (mode & ~S_IFMT)) {
+        return 0;
+    }
+
+    if (has_mtime && (existing.st_mtim.tv_sec != mtime->tv_sec
+                      || existing.st_mtim.tv_nsec != mtime->tv_nsec)) {
+        return 0;
+    }
+
+    if (checksum == NULL) {
+        return 1;
+    }
+
+    digest_entry_t *entry = digest_cache_find(&state->digests, &existing);
+    if (entry != NULL) {
+        return memcmp(entry->digest, checksum, SHA256_DIGEST_BYTES) == 0;
+    }
+
+    // not cached, hash the file and remember the result
+    // a file that can't be read, e.g. mode 0200, or has gone is
+    // not identical, so it is rewritten
+    int fd = openat(parent_fd, basename, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &existing) != 0) {
+        close(fd);
+        return 0;
+    }
+
+    sha256_t sha;
+    sha256_init(&sha);
+    uint8_t buffer[COPY_BUFFER_SIZE];
+    ssize_t n_bytes;
+    while ((n_bytes = read(fd, buffer, sizeof buffer)) > 0) {
+        sha256_update(&sha, buffer, n_bytes);
+    }
+    if (n_bytes < 0) {
+        close(fd);
+        return 0;
+    }
+    close(fd);
+
+    uint8_t digest[SHA256_DIGEST_BYTES];
+    sha256_final(&sha, digest);
+    digest_cache_put(&state->digests, &existing, digest);
+
+    return memcmp(digest, checksum, SHA256_DIGEST_BYTES) == 0;
+}
+
+// check whether the file at pathname already matches a v1 regular file
+// blobette whose content starts at fp's position. the content is read
+// once, updating *hash_p and taking its SHA-256, which is compared with
+// the existing file's digest, cached where possible. if they differ,
+// fp and *hash_p are restored so the content can be extracted
+
+int blobbete_is_identical(FILE *fp, uint8_t *hash_p, extract_state_t *state,
+                          char *pathname, long mode, unsigned long content_length,
+                          int has_mtime, struct timespec *mtime) {
+    // check metadata first, so content isn't read twice for new files
+    if (!member_is_identical(state, pathname, mode, content_length,
+                             has_mtime, mtime, NULL)) {
+        return 0;
+    }
+
+    long content_start = ftell(fp);
+    uint8_t start_hash = *hash_p;
+
+    sha256_t sha;
+    sha256_init(&sha);
+    uint8_t buffer[COPY_BUFFER_SIZE];
+    unsigned long remaining = content_length;
+    while (remaining > 0) {
+        size_t n_bytes = remaining < sizeof buffer ? remaining : sizeof buffer;
+        blobbete_read_content(fp, buffer, n_bytes, hash_p);
+        sha256_update(&sha, buffer, n_bytes);
+        remaining -= n_bytes;
+    }
+    uint8_t digest[SHA256_DIGEST_BYTES];
+    sha256_final(&sha, digest);
+
+    if (member_is_identical(state, pathname, mode, content_length,
+                            has_mtime, mtime, digest)) {
+        return 1;
+    }
+
+    if (fseek(fp, content_start, SEEK_SET) != 0) {
+        perror("fseek");
+        exit(1);
+    }
+    *hash_p = start_hash;
+    return 0;
+}
+
+// load the digest cache from DIGEST_CACHE_PATHNAME in the extraction root
+// a missing cache file is treated as empty
+
+void digest_cache_load(digest_cache_t *cache, int root_fd) {
+    int fd = openat(root_fd, DIGEST_CACHE_PATHNAME, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return;
+        }
+        perror(DIGEST_CACHE_PATHNAME);
+        exit(1);
+    }
+
+    FILE *cache_file = fdopen(fd, "r");
+    if (cache_file == NULL) {
+        perror(DIGEST_CACHE_PATHNAME);
+        exit(1);
+    }
+
+    // each line is: dev ino mtime_sec mtime_nsec ctime_sec ctime_nsec size sha256
+    unsigned long dev, ino;
+    long long mtime_sec, ctime_sec, size;
+    long mtime_nsec, ctime_nsec;
+    char hex[2 * SHA256_DIGEST_BYTES + 1];
+    while (fscanf(cache_file, "%lu %lu %lld %ld %lld %ld %lld %64s", &dev, &ino,
+                  &mtime_sec, &mtime_nsec, &ctime_sec, &ctime_nsec, &size, hex) == 8) {
+        struct stat stats = {
+            .st_dev = dev,
+            .st_ino = ino,
+            .st_mtim = { mtime_sec, mtime_nsec },
+            .st_ctim = { ctime_sec, ctime_nsec },
+            .st_size = size
+        };
+        uint8_t digest[SHA256_DIGEST_BYTES];
+        int valid = strlen(hex) == 2 * SHA256_DIGEST_BYTES;
+        for (int i = 0; valid && i < SHA256_DIGEST_BYTES; i++) {
+            valid = sscanf(&hex[2 * i], "%2hhx", &digest[i]) == 1;
+        }
+        if (valid) {
+            digest_cache_put(cache, &stats, digest);
+        }
+    }
+
+    fclose(cache_file);
+    for (size_t i = 0; i < cache->capacity; i++) {
+        cache->entries[i].seen = 0;
+    }
+    cache->modified = 0;
+}
+
+// write the digest cache back to the extraction root if it changed,
+// keeping only entries looked up or refreshed during this extraction
+// written to a temporary file then renamed into place
+
+void digest_cache_save(digest_cache_t *cache, int root_fd) {
+    int pruned = 0;
+    for (size_t i = 0; i < cache->capacity; i++) {
+        pruned |= cache->entries[i].used && !cache->entries[i].seen;
+    }
+    if (!cache->modified && !pruned) {
+        return;
+    }
+
+    char *tmp_pathname = DIGEST_CACHE_PATHNAME ".tmp";
+    int fd = openat(root_fd, tmp_pathname,
+                    O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+    FILE *cache_file = fd < 0 ? NULL : fdopen(fd, "w");
+    if (cache_file == NULL) {
+        perror(tmp_pathname);
+        exit(1);
+    }
+
+    for (size_t i = 0; i < cache->capacity; i++) {
+        digest_entry_t *entry = &cache->entries[i];
+        if (!entry->used || !entry->seen) {
+            continue;
+        }
+
+        fprintf(cache_file, "%lu %lu %lld %ld %lld %ld %lld ", (unsigned long)entry->dev,
+                (unsigned long)entry->ino, (long long)entry->mtime.tv_sec,
+                (long)entry->mtime.tv_nsec, (long long)entry->ctime.tv_sec,
+                (long)entry->ctime.tv_nsec, (long long)entry->size);
+        for (int j = 0; j < SHA256_DIGEST_BYTES; j++) {
+            fprintf(cache_file, "%02x", entry->digest[j]);
+        }
+        fputc('\n', cache_file);
+    }
+
+    if (fclose(cache_file) != 0
+        || renameat(root_fd, tmp_pathname, root_fd, DIGEST_CACHE_PATHNAME) != 0) {
+        perror(DIGEST_CACHE_PATHNAME);
+        exit(1);
+    }
+}
+
+// return the cached digest for the file described by stats,
+// or NULL if it is not cached or the file has changed since
+
+digest_entry_t *digest_cache_find(digest_cache_t *cache, struct stat *stats) {
+    if (cache->capacity == 0) {
+        return NULL;
+    }
+
+    digest_entry_t *entry = digest_cache_slot(cache, stats->st_dev, stats->st_ino);
+    if (!entry->used || entry->size != stats->st_size
+        || entry->mtime.tv_sec != stats->st_mtim.tv_sec
+        || entry->mtime.tv_nsec != stats->st_mtim.tv_nsec
+        || entry->ctime.tv_sec != stats->st_ctim.tv_sec
+        || entry->ctime.tv_nsec != stats->st_ctim.tv_nsec) {
+        return NULL;
+    }
+
+    entry->seen = 1;
+    return entry;
+}
+
+// record digest for the file described by stats,
+// replacing any entry for the same (dev, ino)
+
+void digest_cache_put(digest_cache_t *cache, struct stat *stats,
+                      uint8_t digest[SHA256_DIGEST_BYTES]) {
+    // keep the table at most half full
+    if (2 * (cache->n_entries + 1) > cache->capacity) {
+        digest_cache_t grown = {
+            .capacity = cache->capacity == 0 ? DIGEST_CACHE_INITIAL_CAPACITY
+                                             : 2 * cache->capacity,
+            .n_entries = 0
+        };
+        grown.entries = calloc(grown.capacity, sizeof *grown.entries);
+        if (grown.entries == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+
+        for (size_t i = 0; i < cache->capacity; i++) {
+            if (cache->entries[i].used) {
+                *digest_cache_slot(&grown, cache->entries[i].dev,
+                                   cache->entries[i].ino) = cache->entries[i];
+                grown.n_entries++;
+            }
+        }
+
+        free(cache->entries);
+        cache->entries = grown.entries;
+        cache->capacity = grown.capacity;
+    }
+
+    digest_entry_t *entry = digest_cache_slot(cache, stats->st_dev, stats->st_ino);
+    if (!entry->used) {
+        cache->n_entries++;
+    }
+    entry->used = 1;
+    entry->seen = 1;
+    entry->dev = stats->st_dev;
+    entry->ino = stats->st_ino;
+    entry->mtime = stats->st_mtim;
+    entry->ctime = stats->st_ctim;
+    entry->size = stats->st_size;
+    memcpy(entry->digest, digest, SHA256_DIGEST_BYTES);
+    cache->modified = 1;
+}
+
+// find the slot for (dev, ino) in the open-addressed table:
+// the entry holding it, or the empty slot where it belongs
+
+digest_entry_t *digest_cache_slot(digest_cache_t *cache, dev_t dev, ino_t ino) {
+    uint64_t key = ((uint64_t)dev * 0x9E3779B97F4A7C15) ^ (uint64_t)ino;
+    key *= 0xFF51AFD7ED558CCD;
+    size_t i = (key >> 32) & (cache->capacity - 1);
+
+    while (cache->entries[i].used
+           && (cache->entries[i].dev != dev || cache->entries[i].ino != ino)) {
+        i = (i + 1) & (cache->capacity - 1);
+    }
+
+    return &cache->entries[i];
+}
+
+// return the size of the blob open on fp
+// taken once when the blob is opened, to bound every header read from it
+
+uint64_t blob_file_size(FILE *fp) {
+    struct stat blob_stats;
+    if (fstat(fileno(fp), &blob_stats) != 0) {
+        perror("fstat");
+        exit(1);
+    }
+
+    return blob_stats.st_size;
+}
+
+// exit with an error unless a blob of blob_size bytes holds n_bytes
+// starting at offset, so lengths read from headers are never trusted
+
+void blob_check_range(uint64_t blob_size, uint64_t offset, uint64_t n_bytes) {
+    if (offset > blob_size || n_bytes > blob_size - offset) {
+        fprintf(stderr, "ERROR: blob truncated\n");
+        exit(1);
+    }
+}
+
+// round offset up to a multiple of alignment (a power of 2)
+
+uint64_t align_up(uint64_t offset, uint64_t alignment) {
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+// create the directory pathname beneath the extraction root
+// its mode and mtime are applied once extraction finishes
+
+void extract_dir(extract_state_t *state, char *pathname, long mode,
+                 int has_mtime, struct timespec *mtime) {
+    char *basename;
+    int parent_fd = extract_open_parent(state, pathname, &basename);
+
+    printf("Creating directory: %s\n", pathname);
+
+    if (mkdirat(parent_fd, basename, S_IRWXU) != 0) {
+        // an existing directory, e.g. from an earlier extraction, may have
+        // a restrictive mode; relax it until the deferred pass restores it
+        struct stat existing;
+        if (errno != EEXIST
+            || fstatat(parent_fd, basename, &existing, AT_SYMLINK_NOFOLLOW) != 0
+            || !S_ISDIR(existing.st_mode)) {
+            perror(pathname);
+            exit(1);
+        }
+
+        if ((existing.st_mode & S_IRWXU) != S_IRWXU
+            && fchmodat(parent_fd, basename, (existing.st_mode & ~S_IFMT) | S_IRWXU, 0) != 0) {
+            perror(pathname);
+            exit(1);
+        }
+    }
+
+    state->dirs = realloc(state->dirs, (state->n_dirs + 1) * sizeof *state->dirs);
+    if (state->dirs == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    pending_dir_t *dir = &state->dirs[state->n_dirs];
+    dir->pathname = strdup(pathname);
+    dir->mode = mode;
+    dir->has_mtime = has_mtime;
+    dir->mtime = *mtime;
+    state->n_dirs++;
+}
+
+// create the regular file pathname beneath the extraction root
+// and return it open for writing
+
+FILE *create_extracted_file(extract_state_t *state, char *pathname) {
+    char *basename;
+    int parent_fd = extract_open_parent(state, pathname, &basename);
+
+    // print process to terminal
+    printf("Extracting: %s\n", pathname);
+
+    // replace rather than truncate an existing file,
+    // which may be read-only from an earlier extraction
+    if (unlinkat(parent_fd, basename, 0) != 0 && errno != ENOENT && errno != EISDIR) {
+        perror(pathname);
+        exit(1);
+    }
+
+    int fd = openat(parent_fd, basename,
+                    O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                    S_IRUSR | S_IWUSR);
+    FILE *extracted_file = fd < 0 ? NULL : fdopen(fd, "w");
+    if (extracted_file == NULL) {
+        perror(pathname);
+        exit(1);
+    }
+
+    return extracted_file;
+}
 
-// ADD YOUR FUNCTIONS HERE
 
 // extract the bytes of mode, construct them together 
 // then return as a long int (updates hash concurrently)
@@ -385,12 +1755,12 @@ long blobbete_mode(FILE *fp, long curr_byte, uint8_t *hash_p) {
     return mode;
 }
 
-// given a character array of BLOBETTE_MAX_PATHNAME_LENGTH,
+// given a character array of BLOBETTE_MAX_PATHNAME_LENGTH + 1,
 // finds the pathname and inserts it into the array.
 // also returns content length of blobette (updates hash concurrently)
 
 unsigned long blobbete_name_content_len(FILE *fp, long curr_byte,
-                                        char pathname[BLOBETTE_MAX_PATHNAME_LENGTH],
+                                        char pathname[BLOBETTE_MAX_PATHNAME_LENGTH + 1],
                                         uint8_t *hash_p) {
     // find length of pathname by constructing 2 bytes
     unsigned int pathname_length = 0;
@@ -421,13 +1791,471 @@ unsigned long blobbete_name_content_len(FILE *fp, long curr_byte,
 
 // equivalent function to fgetc but it also updates the hash
 // using a pointer to the original hash variable
+// exits with an error if the blob ends early
 
 uint8_t fgetc_hash(FILE *fp, uint8_t *hash_p) {
-    uint8_t byte = fgetc(fp);
+    int byte = fgetc(fp);
+    if (byte == EOF) {
+        fprintf(stderr, "ERROR: blob truncated\n");
+        exit(1);
+    }
     *hash_p = blobby_hash(*hash_p, byte);
     return byte;
 }
 
+// read n_bytes of blobette content into buffer (updates hash concurrently)
+
+void blobbete_read_content(FILE *fp, uint8_t *buffer, size_t n_bytes, uint8_t *hash_p) {
+    if (fread(buffer, 1, n_bytes, fp) != n_bytes) {
+        fprintf(stderr, "ERROR: blob truncated\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < n_bytes; i++) {
+        *hash_p = blobby_hash(*hash_p, buffer[i]);
+    }
+}
+
+// read the extended header of a blobette, which holds
+// its preserved mtime (updates hash concurrently)
+
+void blobbete_mtime(FILE *fp, struct timespec *mtime, uint8_t *hash_p) {
+    uint64_t sec = 0;
+    for (int i = 0; i < BLOBETTE_MTIME_SEC_BYTES; i++) {
+        sec = (sec << BITS_IN_BYTE) | fgetc_hash(fp, hash_p);
+    }
+
+    long nsec = 0;
+    for (int i = 0; i < BLOBETTE_MTIME_NSEC_BYTES; i++) {
+        nsec = (nsec << BITS_IN_BYTE) | fgetc_hash(fp, hash_p);
+    }
+
+    mtime->tv_sec = (time_t)sec;
+    mtime->tv_nsec = nsec;
+}
+
+// set mode and mtime of an extracted file through its descriptor,
+// so the path is not looked up again. contents are flushed first
+// so the final write does not clobber the mtime
+
+void apply_file_metadata(FILE *extracted_file, char *pathname, long mode,
+                         int has_mtime, struct timespec *mtime) {
+    if (fflush(extracted_file) != 0) {
+        perror(pathname);
+        exit(1);
+    }
+
+    int fd = fileno(extracted_file);
+    if (fchmod(fd, mode & ~S_IFMT) != 0) {
+        perror(pathname);
+        exit(1);
+    }
+
+    if (has_mtime) {
+        struct timespec times[2] = { { 0, UTIME_OMIT }, *mtime };
+        if (futimens(fd, times) != 0) {
+            perror(pathname);
+            exit(1);
+        }
+    }
+}
+
+// set mode and mtime of every extracted directory, deepest first,
+// so restrictive modes on a parent never block work on its children
+// and creating children does not disturb a parent's restored mtime
+
+void apply_dir_metadata(int root_fd, pending_dir_t *dirs, int n_dirs) {
+    if (n_dirs == 0) {
+        return;
+    }
+    qsort(dirs, n_dirs, sizeof *dirs, pending_dir_deepest_first);
+
+    for (int i = 0; i < n_dirs; i++) {
+        int fd = open_beneath(root_fd, dirs[i].pathname,
+                              O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+        if (fd < 0) {
+            open_beneath_failed(dirs[i].pathname);
+        }
+
+        if (dirs[i].has_mtime) {
+            struct timespec times[2] = { { 0, UTIME_OMIT }, dirs[i].mtime };
+            if (futimens(fd, times) != 0) {
+                perror(dirs[i].pathname);
+                exit(1);
+            }
+        }
+
+        if (fchmod(fd, dirs[i].mode & ~S_IFMT) != 0) {
+            perror(dirs[i].pathname);
+            exit(1);
+        }
+
+        close(fd);
+    }
+}
+
+// qsort comparator ordering directories by decreasing path depth
+
+int pending_dir_deepest_first(const void *a, const void *b) {
+    const pending_dir_t *dir_a = a;
+    const pending_dir_t *dir_b = b;
+
+    int depth_a = 0;
+    for (char *c = dir_a->pathname; *c != '\0'; c++) {
+        depth_a += *c == '/';
+    }
+    int depth_b = 0;
+    for (char *c = dir_b->pathname; *c != '\0'; c++) {
+        depth_b += *c == '/';
+    }
+
+    return depth_b - depth_a;
+}
+
+// open pathname relative to root_fd, refusing to resolve outside it
+// uses openat2 RESOLVE_BENEATH where the kernel supports it, otherwise
+// walks each component with openat, rejecting ".." and symlinks
+// returns -1 with errno set on failure
+
+int open_beneath(int root_fd, char *pathname, int flags, mode_t mode) {
+#ifdef HAVE_OPENAT2
+    struct open_how how = {
+        .flags = flags,
+        .mode = (flags & O_CREAT) ? mode : 0,
+        .resolve = RESOLVE_BENEATH
+    };
+    int fd = syscall(SYS_openat2, root_fd, pathname, &how, sizeof how);
+    if (fd >= 0 || (errno != ENOSYS && errno != EPERM)) {
+        return fd;
+    }
+#endif
+
+    if (pathname[0] == '/') {
+        errno = EXDEV;
+        return -1;
+    }
+
+    char *copy = strdup(pathname);
+    if (copy == NULL) {
+        return -1;
+    }
+
+    int dir_fd = root_fd;
+    char *save;
+    char *component = strtok_r(copy, "/", &save);
+    while (component != NULL) {
+        char *next = strtok_r(NULL, "/", &save);
+
+        int fd;
+        if (strcmp(component, "..") == 0) {
+            errno = EXDEV;
+            fd = -1;
+        } else if (next == NULL) {
+            fd = openat(dir_fd, component, flags | O_NOFOLLOW, mode);
+        } else {
+            fd = openat(dir_fd, component,
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+
+        if (dir_fd != root_fd) {
+            int saved_errno = errno;
+            close(dir_fd);
+            errno = saved_errno;
+        }
+        if (fd < 0 || next == NULL) {
+            free(copy);
+            return fd;
+        }
+
+        dir_fd = fd;
+        component = next;
+    }
+
+    // pathname had no components, e.g. "" or "."
+    free(copy);
+    return openat(root_fd, ".", flags, mode);
+}
+
+// report why open_beneath could not open the member pathname and exit
+
+void open_beneath_failed(char *pathname) {
+    if (errno == EXDEV || errno == ELOOP) {
+        fprintf(stderr, "ERROR: %s: path escapes extraction root\n", pathname);
+    } else {
+        perror(pathname);
+    }
+    exit(1);
+}
+
+// return an fd for the parent directory of pathname beneath root_fd
+// reusing a cached fd when a sibling was extracted recently
+// *basename set to the final component of pathname
+
+int open_parent(int root_fd, parent_fd_cache_t *cache, char *pathname,
+                char **basename) {
+    char *slash = strrchr(pathname, '/');
+    *basename = slash == NULL ? pathname : slash + 1;
+
+    if (**basename == '\0' || strcmp(*basename, ".") == 0
+        || strcmp(*basename, "..") == 0) {
+        fprintf(stderr, "ERROR: invalid pathname in blob: %s\n", pathname);
+        exit(1);
+    }
+
+    if (slash == NULL) {
+        return root_fd;
+    }
+
+    // look up the parent with the final component cut off
+    *slash = '\0';
+    for (int i = 0; i < PARENT_FD_CACHE_SIZE; i++) {
+        if (cache->pathnames[i] != NULL && strcmp(cache->pathnames[i], pathname) == 0) {
+            *slash = '/';
+            return cache->fds[i];
+        }
+    }
+
+    int fd = open_beneath(root_fd, slash == pathname ? "/" : pathname,
+                          O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        *slash = '/';
+        open_beneath_failed(pathname);
+    }
+
+    // replace the oldest entry
+    int slot = cache->next;
+    if (cache->pathnames[slot] != NULL) {
+        free(cache->pathnames[slot]);
+        close(cache->fds[slot]);
+    }
+    cache->pathnames[slot] = strdup(pathname);
+    cache->fds[slot] = fd;
+    cache->next = (slot + 1) % PARENT_FD_CACHE_SIZE;
+
+    *slash = '/';
+    return fd;
+}
+
+// open_parent for a member being extracted, rejecting members that
+// would replace the digest cache kept in the extraction root
+
+int extract_open_parent(extract_state_t *state, char *pathname, char **basename) {
+    int parent_fd = open_parent(state->root_fd, &state->parent_cache,
+                                pathname, basename);
+    if (!state->skip_identical
+        || (strcmp(*basename, DIGEST_CACHE_PATHNAME) != 0
+            && strcmp(*basename, DIGEST_CACHE_PATHNAME ".tmp") != 0)) {
+        return parent_fd;
+    }
+
+    // the parent may be the root reached by another path, e.g. "./"
+    struct stat parent_stats, root_stats;
+    if (fstat(parent_fd, &parent_stats) != 0 || fstat(state->root_fd, &root_stats) != 0) {
+        perror(pathname);
+        exit(1);
+    }
+    if (parent_stats.st_dev == root_stats.st_dev
+        && parent_stats.st_ino == root_stats.st_ino) {
+        fprintf(stderr, "ERROR: %s would replace the --skip-identical digest cache\n",
+                pathname);
+        exit(1);
+    }
+
+    return parent_fd;
+}
+
+// SHA-256 (FIPS 180-4), used as the v2 content checksum
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_init(sha256_t *sha) {
+    static const uint32_t initial_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(sha->state, initial_state, sizeof initial_state);
+    sha->length = 0;
+    sha->block_length = 0;
+}
+
+void sha256_update(sha256_t *sha, const uint8_t *data, size_t length) {
+    sha->length += length;
+
+    // top up a partial block first
+    if (sha->block_length > 0) {
+        size_t n_bytes = SHA256_BLOCK_BYTES - sha->block_length;
+        if (n_bytes > length) {
+            n_bytes = length;
+        }
+        memcpy(sha->block + sha->block_length, data, n_bytes);
+        sha->block_length += n_bytes;
+        data += n_bytes;
+        length -= n_bytes;
+
+        if (sha->block_length < SHA256_BLOCK_BYTES) {
+            return;
+        }
+        sha256_block(sha, sha->block);
+        sha->block_length = 0;
+    }
+
+    // then whole blocks straight from data
+    while (length >= SHA256_BLOCK_BYTES) {
+        sha256_block(sha, data);
+        data += SHA256_BLOCK_BYTES;
+        length -= SHA256_BLOCK_BYTES;
+    }
+
+    memcpy(sha->block, data, length);
+    sha->block_length = length;
+}
+
+void sha256_final(sha256_t *sha, uint8_t digest[SHA256_DIGEST_BYTES]) {
+    uint64_t bit_length = sha->length * BITS_IN_BYTE;
+
+    // pad with a 1 bit, zeros, then the message length in bits
+    sha->block[sha->block_length++] = 0x80;
+    if (sha->block_length > SHA256_BLOCK_BYTES - 8) {
+        memset(sha->block + sha->block_length, 0, SHA256_BLOCK_BYTES - sha->block_length);
+        sha256_block(sha, sha->block);
+        sha->block_length = 0;
+    }
+    memset(sha->block + sha->block_length, 0, SHA256_BLOCK_BYTES - 8 - sha->block_length);
+    for (int i = 0; i < 8; i++) {
+        sha->block[SHA256_BLOCK_BYTES - 1 - i] = (bit_length >> (i * BITS_IN_BYTE)) & LAST_8_BITS;
+    }
+    sha256_block(sha, sha->block);
+
+    for (int i = 0; i < SHA256_DIGEST_BYTES; i++) {
+        digest[i] = (sha->state[i / 4] >> (24 - (i % 4) * BITS_IN_BYTE)) & LAST_8_BITS;
+    }
+}
+
+// hash one block, with the x86 SHA extensions where the CPU has them
+
+#ifdef HAVE_SHA_NI
+static pthread_once_t sha256_detect_once = PTHREAD_ONCE_INIT;
+static int sha256_has_sha_ni;
+
+void sha256_detect_sha_ni(void) {
+    unsigned int eax, ebx, ecx, edx;
+    sha256_has_sha_ni = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1)
+                        && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)
+                        && (ebx & bit_SHA);
+}
+#endif
+
+void sha256_block(sha256_t *sha, const uint8_t block[SHA256_BLOCK_BYTES]) {
+#ifdef HAVE_SHA_NI
+    pthread_once(&sha256_detect_once, sha256_detect_sha_ni);
+    if (sha256_has_sha_ni) {
+        sha256_block_sha_ni(sha, block);
+        return;
+    }
+#endif
+    sha256_block_generic(sha, block);
+}
+
+void sha256_block_generic(sha256_t *sha, const uint8_t block[SHA256_BLOCK_BYTES]) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16
+               | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = SHA256_ROTR(w[i - 15], 7) ^ SHA256_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = SHA256_ROTR(w[i - 2], 17) ^ SHA256_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = sha->state[0], b = sha->state[1], c = sha->state[2], d = sha->state[3];
+    uint32_t e = sha->state[4], f = sha->state[5], g = sha->state[6], h = sha->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 = SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    sha->state[0] += a;
+    sha->state[1] += b;
+    sha->state[2] += c;
+    sha->state[3] += d;
+    sha->state[4] += e;
+    sha->state[5] += f;
+    sha->state[6] += g;
+    sha->state[7] += h;
+}
+
+#ifdef HAVE_SHA_NI
+
+// the same compression with SHA-NI: state is kept as ABEF and CDGH
+// vectors, and each group of 4 rounds takes 4 words of the schedule
+
+__attribute__((target("sha,sse4.1")))
+void sha256_block_sha_ni(sha256_t *sha, const uint8_t block[SHA256_BLOCK_BYTES]) {
+    const __m128i byteswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i cdab = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&sha->state[0]), 0xB1);
+    __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&sha->state[4]), 0x1B);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+    __m128i abef_start = abef;
+    __m128i cdgh_start = cdgh;
+
+    __m128i w[4];
+    for (int i = 0; i < 16; i++) {
+        __m128i words;
+        if (i < 4) {
+            words = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&block[16 * i]), byteswap);
+        } else {
+            // w[i % 4] still holds the words of group i - 4
+            words = _mm_sha256msg1_epu32(w[i % 4], w[(i + 1) % 4]);
+            words = _mm_add_epi32(words, _mm_alignr_epi8(w[(i + 3) % 4], w[(i + 2) % 4], 4));
+            words = _mm_sha256msg2_epu32(words, w[(i + 3) % 4]);
+        }
+        w[i % 4] = words;
+
+        __m128i round_input = _mm_add_epi32(words,
+                                            _mm_loadu_si128((const __m128i *)&sha256_k[4 * i]));
+        cdgh = _mm_sha256rnds2_epu32(cdgh, abef, round_input);
+        abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(round_input, 0x0E));
+    }
+
+    abef = _mm_add_epi32(abef, abef_start);
+    cdgh = _mm_add_epi32(cdgh, cdgh_start);
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128((__m128i *)&sha->state[0], _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128((__m128i *)&sha->state[4], _mm_alignr_epi8(dchg, feba, 8));
+}
+
+#endif
+
 // YOU SHOULD NOT CHANGE CODE BELOW HERE
 
 // Lookup table for a simple Pearson hash
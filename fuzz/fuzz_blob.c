@@ -0,0 +1,326 @@
+// fuzz_blob.c
+// libFuzzer/AFL target for blobby's v1 and v2 blob readers
+//
+// each input is written to a temporary blob, which is listed, extracted
+// into an empty directory, then extracted again with --skip-identical
+// blobby reports bad blobs with exit(1); here exit returns to the target
+// instead, closing and freeing whatever the reader had open or allocated
+//
+// built with -DFUZZ_STANDALONE it reads inputs from files named on the
+// command line (or stdin), for AFL or compilers without libFuzzer
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#define FUZZ_MAX_FDS   1024
+#define FUZZ_MAX_FILES 64
+
+FILE *fuzz_track(FILE *fp);
+int fuzz_fclose(FILE *fp);
+void *fuzz_track_allocation(void *old, void *allocation);
+char *fuzz_strdup(const char *s);
+void fuzz_free(void *allocation);
+void fuzz_exit(int status);
+
+// blobby's main is not used, and exit, streams and allocations are
+// routed through the harness so a rejected blob can be abandoned
+#undef strdup
+#define main blobby_main
+#define exit(status) fuzz_exit(status)
+#define fopen(pathname, mode) fuzz_track(fopen(pathname, mode))
+#define fdopen(fd, mode) fuzz_track(fdopen(fd, mode))
+#define fclose(fp) fuzz_fclose(fp)
+#define malloc(size) fuzz_track_allocation(NULL, malloc(size))
+#define calloc(n, size) fuzz_track_allocation(NULL, calloc(n, size))
+#define realloc(old, size) fuzz_track_allocation(old, realloc(old, size))
+#define strdup(s) fuzz_strdup(s)
+#define free(allocation) fuzz_free(allocation)
+
+#include "../blobby.c"
+
+#undef main
+#undef exit
+#undef fopen
+#undef fdopen
+#undef fclose
+#undef malloc
+#undef calloc
+#undef realloc
+#undef strdup
+#undef free
+
+static jmp_buf fuzz_return;
+static int fuzz_running;
+static FILE *fuzz_files[FUZZ_MAX_FILES];
+static void **fuzz_allocations;
+static size_t fuzz_n_allocations;
+static size_t fuzz_allocations_capacity;
+static uint8_t fuzz_fds_open[FUZZ_MAX_FDS];
+static char fuzz_dir[] = "/tmp/fuzz_blob.XXXXXX";
+static char fuzz_blob_pathname[sizeof fuzz_dir + 16];
+static char fuzz_root_pathname[sizeof fuzz_dir + 16];
+
+// remember fp so it can be closed if the reader exits
+
+FILE *fuzz_track(FILE *fp) {
+    for (int i = 0; fp != NULL && i < FUZZ_MAX_FILES; i++) {
+        if (fuzz_files[i] == NULL) {
+            fuzz_files[i] = fp;
+            break;
+        }
+    }
+    return fp;
+}
+
+// fclose a tracked stream
+
+int fuzz_fclose(FILE *fp) {
+    for (int i = 0; i < FUZZ_MAX_FILES; i++) {
+        if (fuzz_files[i] == fp) {
+            fuzz_files[i] = NULL;
+        }
+    }
+    return fclose(fp);
+}
+
+// remember an allocation blobby made, replacing old if it was realloc'd
+// so it can be freed if the reader exits
+
+void *fuzz_track_allocation(void *old, void *allocation) {
+    if (allocation == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = fuzz_n_allocations; old != NULL && i > 0; i--) {
+        if (fuzz_allocations[i - 1] == old) {
+            fuzz_allocations[i - 1] = allocation;
+            return allocation;
+        }
+    }
+
+    if (fuzz_n_allocations == fuzz_allocations_capacity) {
+        fuzz_allocations_capacity = fuzz_allocations_capacity ? 2 * fuzz_allocations_capacity : 256;
+        fuzz_allocations = realloc(fuzz_allocations,
+                                   fuzz_allocations_capacity * sizeof *fuzz_allocations);
+        if (fuzz_allocations == NULL) {
+            perror("realloc");
+            abort();
+        }
+    }
+    fuzz_allocations[fuzz_n_allocations++] = allocation;
+    return allocation;
+}
+
+char *fuzz_strdup(const char *s) {
+    return fuzz_track_allocation(NULL, strdup(s));
+}
+
+// free a tracked allocation
+
+void fuzz_free(void *allocation) {
+    for (size_t i = fuzz_n_allocations; allocation != NULL && i > 0; i--) {
+        if (fuzz_allocations[i - 1] == allocation) {
+            fuzz_allocations[i - 1] = fuzz_allocations[--fuzz_n_allocations];
+            fuzz_allocations[fuzz_n_allocations] = NULL;
+            break;
+        }
+    }
+    free(allocation);
+}
+
+// stop tracking allocations, freeing them if the reader exited
+// otherwise the table is cleared, so anything a finished reader
+// didn't free is reported as a leak rather than held reachable here
+
+void fuzz_forget_allocations(int free_them) {
+    for (size_t i = 0; i < fuzz_n_allocations; i++) {
+        if (free_them) {
+            free(fuzz_allocations[i]);
+        }
+        fuzz_allocations[i] = NULL;
+    }
+    fuzz_n_allocations = 0;
+}
+
+// blobby's exit: return to the target, or really exit outside it
+
+void fuzz_exit(int status) {
+    if (!fuzz_running) {
+        exit(status);
+    }
+    longjmp(fuzz_return, 1);
+}
+
+// close the streams and fds a reader left open when it exited
+// and free what it allocated
+
+void fuzz_close_leftovers(void) {
+    for (int i = 0; i < FUZZ_MAX_FILES; i++) {
+        if (fuzz_files[i] != NULL) {
+            fclose(fuzz_files[i]);
+            fuzz_files[i] = NULL;
+        }
+    }
+
+    for (int fd = 0; fd < FUZZ_MAX_FDS; fd++) {
+        if (!fuzz_fds_open[fd] && fcntl(fd, F_GETFD) != -1) {
+            close(fd);
+        }
+    }
+
+    fuzz_forget_allocations(1);
+}
+
+// make a directory searchable and writable so its contents can be removed
+
+int fuzz_unlock(const char *pathname, const struct stat *stats, int type,
+                struct FTW *ftw) {
+    if (type == FTW_D) {
+        chmod(pathname, S_IRWXU);
+    }
+    return 0;
+}
+
+// remove one entry of the extraction directory
+
+int fuzz_remove(const char *pathname, const struct stat *stats, int type,
+                struct FTW *ftw) {
+    if (ftw->level > 0) {
+        remove(pathname);
+    }
+    return 0;
+}
+
+// run one reader on the blob, returning once it finishes or exits
+
+void fuzz_run(void (*reader)(void)) {
+    for (int fd = 0; fd < FUZZ_MAX_FDS; fd++) {
+        fuzz_fds_open[fd] = fcntl(fd, F_GETFD) != -1;
+    }
+
+    fuzz_running = 1;
+    if (setjmp(fuzz_return) == 0) {
+        reader();
+        fuzz_forget_allocations(0);
+    } else {
+        fuzz_close_leftovers();
+    }
+    fuzz_running = 0;
+}
+
+void fuzz_list(void) {
+    list_blob(fuzz_blob_pathname);
+}
+
+void fuzz_extract(void) {
+    extract_blob(fuzz_blob_pathname, fuzz_root_pathname, 0);
+}
+
+void fuzz_extract_skip_identical(void) {
+    extract_blob(fuzz_blob_pathname, fuzz_root_pathname, 1);
+}
+
+// remove the working directory when the fuzzer exits
+
+void fuzz_cleanup(void) {
+    nftw(fuzz_dir, fuzz_unlock, 16, FTW_PHYS);
+    nftw(fuzz_dir, fuzz_remove, 16, FTW_PHYS | FTW_DEPTH);
+    rmdir(fuzz_dir);
+}
+
+// create the working directory once; blobby's output is discarded
+
+void fuzz_init(void) {
+    if (mkdtemp(fuzz_dir) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    atexit(fuzz_cleanup);
+    snprintf(fuzz_blob_pathname, sizeof fuzz_blob_pathname, "%s/blob", fuzz_dir);
+    snprintf(fuzz_root_pathname, sizeof fuzz_root_pathname, "%s/root", fuzz_dir);
+
+    if (freopen("/dev/null", "w", stdout) == NULL) {
+        perror("/dev/null");
+        exit(1);
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static int initialised = 0;
+    if (!initialised) {
+        fuzz_init();
+        initialised = 1;
+    }
+
+    FILE *blob = fopen(fuzz_blob_pathname, "w");
+    if (blob == NULL || fwrite(data, 1, size, blob) != size || fclose(blob) != 0) {
+        perror(fuzz_blob_pathname);
+        exit(1);
+    }
+    if (mkdir(fuzz_root_pathname, S_IRWXU) != 0) {
+        perror(fuzz_root_pathname);
+        exit(1);
+    }
+
+    fuzz_run(fuzz_list);
+    fuzz_run(fuzz_extract);
+    fuzz_run(fuzz_extract_skip_identical);
+
+    nftw(fuzz_root_pathname, fuzz_unlock, 16, FTW_PHYS);
+    nftw(fuzz_root_pathname, fuzz_remove, 16, FTW_PHYS | FTW_DEPTH);
+    if (rmdir(fuzz_root_pathname) != 0) {
+        perror(fuzz_root_pathname);
+        exit(1);
+    }
+
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+
+// run the target on each file named, or on stdin if there are none
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc || i == 1; i++) {
+        FILE *input = argc > 1 ? fopen(argv[i], "r") : stdin;
+        if (input == NULL) {
+            perror(argv[i]);
+            return 1;
+        }
+
+        size_t size = 0;
+        size_t capacity = 1 << 16;
+        uint8_t *data = malloc(capacity);
+        size_t n_bytes;
+        while (data != NULL && (n_bytes = fread(data + size, 1, capacity - size, input)) > 0) {
+            size += n_bytes;
+            if (size == capacity) {
+                capacity *= 2;
+                data = realloc(data, capacity);
+            }
+        }
+        if (data == NULL) {
+            perror("realloc");
+            return 1;
+        }
+        if (input != stdin) {
+            fclose(input);
+        }
+
+        LLVMFuzzerTestOneInput(data, size);
+        free(data);
+    }
+
+    return 0;
+}
+
+#endif
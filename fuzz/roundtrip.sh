@@ -0,0 +1,236 @@
+#!/bin/bash
+# roundtrip.sh
+# randomized create -> list -> extract -> compare round trips for blobby
+#
+# usage: fuzz/roundtrip.sh [blobby] [iterations] [seed]
+#
+# each iteration builds a random tree of directories and empty, small,
+# sparse and large files, then for every blob variant checks that the
+# listing matches the tree, that extraction reproduces it, and that
+# --skip-identical rewrites a modified file and leaves the rest alone.
+# a write-only file, patched into a v2 blob, is checked the same way,
+# as are blobs not made by this blobby: the examples and fuzz/seeds
+
+set -eu
+
+blobby=$(realpath "${1:-./blobby}")
+here=$(dirname "$(realpath "$0")")
+iterations=${2:-3}
+seed=${3:-$$}
+RANDOM=$seed
+
+variants=("" "-p" "-z" "--direct" "-2" "-2 --direct")
+
+work=$(mktemp -d)
+trap 'chmod -R u+rwx "$work"; rm -rf "$work"' EXIT
+
+fail() {
+    echo "FAIL (seed $seed, variant '$variant'): $*" >&2
+    exit 1
+}
+
+random_name() {
+    local chars=abcdefghijklmnopqrstuvwxyz0123456789._-
+    local name=${chars:$((RANDOM % 26)):1}
+    for _ in $(seq $((RANDOM % 12))); do
+        name+=${chars:$((RANDOM % ${#chars})):1}
+    done
+    echo "$name"
+}
+
+# fill directory $1 with a random tree, $2 levels deep at most
+make_tree() {
+    local dir=$1 depth=$2
+    for _ in $(seq $((RANDOM % 6 + 1))); do
+        local path=$dir/$(random_name)
+        [ -e "$path" ] && continue
+        case $((RANDOM % 10)) in
+        0|1)
+            if [ "$depth" -gt 0 ]; then
+                mkdir "$path"
+                make_tree "$path" $((depth - 1))
+            else
+                : > "$path"
+            fi
+            ;;
+        2)
+            : > "$path"
+            ;;
+        3)
+            # sparse: holes around a few written blocks
+            truncate -s $((RANDOM % 32 + 1))M "$path"
+            for _ in 1 2 3; do
+                head -c 4096 /dev/urandom | dd of="$path" bs=4096 \
+                    seek=$((RANDOM % 4096)) conv=notrunc status=none
+            done
+            ;;
+        4)
+            # larger than both halves of the writer's 2 x 4 MiB buffer
+            head -c $((8 * 1024 * 1024 + RANDOM)) /dev/urandom > "$path"
+            ;;
+        *)
+            head -c $((RANDOM % 20000)) /dev/urandom > "$path"
+            ;;
+        esac
+    done
+}
+
+# give the tree under $1 random modes, directories last so they stay writable
+randomize_modes() {
+    local modes=(644 600 755 444 400 700)
+    find "$1" -mindepth 1 -type f | while read -r path; do
+        chmod "${modes[$((RANDOM % ${#modes[@]}))]}" "$path"
+    done
+    find "$1" -mindepth 1 -depth -type d | while read -r path; do
+        chmod "$([ $((RANDOM % 3)) -eq 0 ] && echo 555 || echo 755)" "$path"
+    done
+}
+
+# the listing blobby should print for the members of $1
+expected_listing() {
+    (cd "$1" && find . -mindepth 1 | sed 's|^\./||') | while read -r path; do
+        local mode size
+        read -r mode size < <(stat -c '%f %s' "$1/$path")
+        [ -d "$1/$path" ] && size=0
+        printf "%06o %5d %s\n" $((16#$mode)) "$size" "$path"
+    done
+}
+
+# modes and types of everything under $1, plus mtimes if $2 is set
+tree_metadata() {
+    local format='%m %y %P\n'
+    [ -n "${2:-}" ] && format='%m %y %T@ %P\n'
+    (cd "$1" && find . -mindepth 1 -not -name .blobby-digests -printf "$format" | sort)
+}
+
+# exit unless $2 holds the same content and metadata as the tree in $1
+compare_trees() {
+    diff -r -x .blobby-digests "$1" "$2" > /dev/null || fail "$3: content differs"
+    [ "$(tree_metadata "$1" "$with_mtimes")" = "$(tree_metadata "$2" "$with_mtimes")" ] \
+        || fail "$3: metadata differs"
+}
+
+# a write-only (mode 0200) file can't be read back to compare with its
+# member, so --skip-identical must rewrite it rather than fail. blobby
+# can't read such a file to add it, so the mode is patched into a v2 blob
+check_write_only() {
+    local dir=$work/write-only
+    variant="-2 (mode 0200)"
+    mkdir -p "$dir/src" "$dir/out"
+    head -c 1000 /dev/urandom > "$dir/src/wo"
+    (cd "$dir/src" && "$blobby" -2 -c "$dir/blob" wo) > /dev/null || fail "create"
+
+    # the only member header follows the 24-byte file header, mode at +4
+    printf '\200\200\000\000' | dd of="$dir/blob" bs=1 seek=28 conv=notrunc status=none
+    [ "$("$blobby" -l "$dir/blob")" = "$(printf '%06o %5d wo' $((0100200)) 1000)" ] \
+        || fail "listing differs"
+
+    "$blobby" -C "$dir/out" -x "$dir/blob" > /dev/null || fail "extract"
+    "$blobby" -C "$dir/out" --skip-identical -x "$dir/blob" > /dev/null \
+        || fail "--skip-identical"
+    [ "$(stat -c %a "$dir/out/wo")" = 200 ] || fail "mode differs"
+    chmod u+r "$dir/out/wo"
+    cmp -s "$dir/src/wo" "$dir/out/wo" || fail "content differs"
+}
+
+# blobs not made by this blobby: the uncompressed blobs in examples.zip
+# and those in seeds/, e.g. from earlier versions that gave directories
+# content, must extract to their .d reference trees, and those with a
+# bad hash or magic byte must be rejected
+check_reference_blobs() {
+    local dir=$work/reference
+    mkdir -p "$dir"
+    unzip -q "$here/../examples.zip" -d "$dir"
+
+    for blob in "$dir"/examples/*.blob "$here"/seeds/*.blob; do
+        variant=$(basename "$blob")
+        case $blob in *.compressed.blob) continue ;; esac
+        rm -rf "$dir/out"
+        mkdir "$dir/out"
+
+        case $blob in
+        *.bad_*)
+            if "$blobby" -C "$dir/out" -x "$blob" > /dev/null 2>&1; then
+                fail "bad blob extracted"
+            fi
+            continue
+            ;;
+        esac
+
+        "$blobby" -l "$blob" > /dev/null || fail "list"
+        "$blobby" -C "$dir/out" -x "$blob" > /dev/null || fail "extract"
+        diff -r "${blob%.blob}.d" "$dir/out" > /dev/null || fail "differs from reference tree"
+
+        # the first run records digests, the second must find nothing to do
+        "$blobby" -C "$dir/out" --skip-identical -x "$blob" > /dev/null || fail "--skip-identical"
+        result=$("$blobby" -C "$dir/out" --skip-identical -x "$blob") || fail "--skip-identical"
+        if grep -q '^Extracting: ' <<< "$result"; then
+            fail "--skip-identical rewrote unchanged files"
+        fi
+    done
+}
+
+check_write_only
+check_reference_blobs
+
+for iteration in $(seq "$iterations"); do
+    chmod -R u+rwx "$work"
+    rm -rf "${work:?}"/*
+    mkdir "$work/src"
+    make_tree "$work/src" 3
+    mapfile -t pathnames < <(cd "$work/src" && find . -mindepth 1 | sed 's|^\./||')
+    randomize_modes "$work/src"
+    listing=$(expected_listing "$work/src")
+
+    for variant in "${variants[@]}"; do
+        blob=$work/blob
+        out=$work/out
+        rm -f "$blob"
+        if [ -d "$out" ]; then
+            chmod -R u+rwx "$out"
+            rm -rf "$out"
+        fi
+        mkdir "$out"
+
+        with_mtimes=
+        case $variant in *-p*|*-2*) with_mtimes=1 ;; esac
+
+        # shellcheck disable=SC2086
+        (cd "$work/src" && "$blobby" $variant -c "$blob" "${pathnames[@]}") > /dev/null \
+            || fail "create"
+
+        [ "$("$blobby" -l "$blob")" = "$listing" ] || fail "listing differs"
+
+        "$blobby" -C "$out" -x "$blob" > /dev/null || fail "extract"
+        compare_trees "$work/src" "$out" "extract"
+
+        # over an earlier extraction, including read-only files and directories
+        "$blobby" -C "$out" -x "$blob" > /dev/null || fail "re-extract"
+        compare_trees "$work/src" "$out" "re-extract"
+
+        # change one byte of a non-empty file, keeping its size and mode
+        changed=$(cd "$out" && find . -type f -size +0 -printf '%P\n' | head -1)
+        if [ -n "$changed" ]; then
+            mode=$(stat -c %a "$out/$changed")
+            chmod u+w "$out/$changed"
+            byte=$(head -c 1 "$out/$changed" | od -An -tu1)
+            printf "\\$(printf %03o $(((byte + 1) % 256)))" \
+                | dd of="$out/$changed" conv=notrunc status=none
+            chmod "$mode" "$out/$changed"
+        fi
+
+        result=$("$blobby" -C "$out" --skip-identical -x "$blob") || fail "--skip-identical"
+        if [ -n "$changed" ] && ! grep -qxF "Extracting: $changed" <<< "$result"; then
+            fail "--skip-identical kept modified $changed"
+        fi
+        compare_trees "$work/src" "$out" "--skip-identical"
+
+        result=$("$blobby" -C "$out" --skip-identical -x "$blob") || fail "--skip-identical"
+        if grep -q '^Extracting: ' <<< "$result"; then
+            fail "--skip-identical rewrote unchanged files"
+        fi
+        compare_trees "$work/src" "$out" "--skip-identical"
+    done
+
+    echo "iteration $iteration: ${#pathnames[@]} members, ${#variants[@]} variants ok"
+done